@@ -0,0 +1,357 @@
+/*
+ * arch/aarch64/bitmap.c
+ * NEON and SVE variants of the bitmap word loops.
+ *
+ * Vectors cover the whole words of a bitmap, the trailing partial word
+ * (and for NEON the odd word) is left to the generic code so that the
+ * result is identical to it. NEON is part of the base ISA, the SVE
+ * functions are compiled for it through the target attribute (GCC 10 or
+ * later) and only used if the CPU has it, the rest of the program stays
+ * baseline aarch64.
+ */
+#include <types.h>
+#include <bitops.h>
+#include <bitmap.h>
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_sve.h>
+
+#define NEON_WORDS	(128 / BITS_PER_LONG)
+
+/* Number of words the NEON loops cover */
+static inline int neon_words(int bits)
+{
+	return (bits / (int)BITS_PER_LONG) & ~(NEON_WORDS - 1);
+}
+
+#define TAIL_BITS(bits, k)	((bits) - (k) * (int)BITS_PER_LONG)
+
+static inline int neon_nonzero(uint64x2_t v)
+{
+	return vmaxvq_u32(vreinterpretq_u32_u64(v)) != 0;
+}
+
+/*
+ * NEON
+ */
+static int bitmap_and_neon(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+	uint64x2_t acc = vdupq_n_u64(0);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		uint64x2_t r = vandq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+				vld1q_u64((const uint64_t *)&bitmap2[k]));
+
+		vst1q_u64((uint64_t *)&dst[k], r);
+		acc = vorrq_u64(acc, r);
+	}
+
+	return __bitmap_and_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | neon_nonzero(acc);
+}
+
+static void bitmap_or_neon(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		vst1q_u64((uint64_t *)&dst[k],
+				vorrq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+					vld1q_u64((const uint64_t *)&bitmap2[k])));
+	}
+
+	__bitmap_or_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+static int bitmap_andnot_neon(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+	uint64x2_t acc = vdupq_n_u64(0);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		/* bic: first & ~second */
+		uint64x2_t r = vbicq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+				vld1q_u64((const uint64_t *)&bitmap2[k]));
+
+		vst1q_u64((uint64_t *)&dst[k], r);
+		acc = vorrq_u64(acc, r);
+	}
+
+	return __bitmap_andnot_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | neon_nonzero(acc);
+}
+
+static int bitmap_intersects_neon(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		if (neon_nonzero(vandq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+					vld1q_u64((const uint64_t *)&bitmap2[k]))))
+			return 1;
+	}
+
+	return __bitmap_intersects_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+static int bitmap_subset_neon(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		if (neon_nonzero(vbicq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+					vld1q_u64((const uint64_t *)&bitmap2[k]))))
+			return 0;
+	}
+
+	return __bitmap_subset_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+static int bitmap_equal_neon(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = neon_words(bits);
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		if (neon_nonzero(veorq_u64(vld1q_u64((const uint64_t *)&bitmap1[k]),
+					vld1q_u64((const uint64_t *)&bitmap2[k]))))
+			return 0;
+	}
+
+	return __bitmap_equal_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+static int bitmap_weight_neon(const unsigned long *bitmap, int bits)
+{
+	int k, lim = neon_words(bits);
+	int w = 0;
+
+	for (k = 0; k < lim; k += NEON_WORDS) {
+		uint8x16_t v = vreinterpretq_u8_u64(
+				vld1q_u64((const uint64_t *)&bitmap[k]));
+
+		w += vaddlvq_u8(vcntq_u8(v));
+	}
+
+	return w + __bitmap_weight_generic(bitmap + k, TAIL_BITS(bits, k));
+}
+
+static const struct bitmap_ops bitmap_neon_ops = {
+	.name = "neon",
+	.and = bitmap_and_neon,
+	.or = bitmap_or_neon,
+	.andnot = bitmap_andnot_neon,
+	.intersects = bitmap_intersects_neon,
+	.subset = bitmap_subset_neon,
+	.equal = bitmap_equal_neon,
+	.weight = bitmap_weight_neon,
+};
+
+static int has_neon(void)
+{
+	return 1;
+}
+
+/*
+ * SVE, predicated loops over the whole words regardless of the vector
+ * length.
+ */
+#define __sve	__attribute__((target("+sve")))
+
+#define SVE_LOAD(pg, map, k)	svld1_u64(pg, (const uint64_t *)&(map)[k])
+
+__sve
+static int bitmap_and_sve(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	int result = 0;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		svuint64_t r;
+
+		pg = svwhilelt_b64(k, lim);
+		r = svand_u64_z(pg, SVE_LOAD(pg, bitmap1, k), SVE_LOAD(pg, bitmap2, k));
+		svst1_u64(pg, (uint64_t *)&dst[k], r);
+		result |= svptest_any(pg, svcmpne_n_u64(pg, r, 0));
+	}
+
+	return __bitmap_and_generic(dst + lim, bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim)) | result;
+}
+
+__sve
+static void bitmap_or_sve(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		pg = svwhilelt_b64(k, lim);
+		svst1_u64(pg, (uint64_t *)&dst[k], svorr_u64_z(pg,
+					SVE_LOAD(pg, bitmap1, k), SVE_LOAD(pg, bitmap2, k)));
+	}
+
+	__bitmap_or_generic(dst + lim, bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim));
+}
+
+__sve
+static int bitmap_andnot_sve(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	int result = 0;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		svuint64_t r;
+
+		pg = svwhilelt_b64(k, lim);
+		r = svbic_u64_z(pg, SVE_LOAD(pg, bitmap1, k), SVE_LOAD(pg, bitmap2, k));
+		svst1_u64(pg, (uint64_t *)&dst[k], r);
+		result |= svptest_any(pg, svcmpne_n_u64(pg, r, 0));
+	}
+
+	return __bitmap_andnot_generic(dst + lim, bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim)) | result;
+}
+
+__sve
+static int bitmap_intersects_sve(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		pg = svwhilelt_b64(k, lim);
+		if (svptest_any(pg, svcmpne_n_u64(pg, svand_u64_z(pg,
+							SVE_LOAD(pg, bitmap1, k),
+							SVE_LOAD(pg, bitmap2, k)), 0)))
+			return 1;
+	}
+
+	return __bitmap_intersects_generic(bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim));
+}
+
+__sve
+static int bitmap_subset_sve(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		pg = svwhilelt_b64(k, lim);
+		if (svptest_any(pg, svcmpne_n_u64(pg, svbic_u64_z(pg,
+							SVE_LOAD(pg, bitmap1, k),
+							SVE_LOAD(pg, bitmap2, k)), 0)))
+			return 0;
+	}
+
+	return __bitmap_subset_generic(bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim));
+}
+
+__sve
+static int bitmap_equal_sve(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		pg = svwhilelt_b64(k, lim);
+		if (svptest_any(pg, svcmpne_u64(pg, SVE_LOAD(pg, bitmap1, k),
+						SVE_LOAD(pg, bitmap2, k))))
+			return 0;
+	}
+
+	return __bitmap_equal_generic(bitmap1 + lim, bitmap2 + lim,
+			TAIL_BITS(bits, lim));
+}
+
+__sve
+static int bitmap_weight_sve(const unsigned long *bitmap, int bits)
+{
+	int k, lim = bits / BITS_PER_LONG;
+	svuint64_t acc = svdup_n_u64(0);
+	svbool_t pg;
+
+	for (k = 0; k < lim; k += svcntd()) {
+		pg = svwhilelt_b64(k, lim);
+		acc = svadd_u64_m(pg, acc, svcnt_u64_z(pg, SVE_LOAD(pg, bitmap, k)));
+	}
+
+	return svaddv_u64(svptrue_b64(), acc) +
+		__bitmap_weight_generic(bitmap + lim, TAIL_BITS(bits, lim));
+}
+
+static const struct bitmap_ops bitmap_sve_ops = {
+	.name = "sve",
+	.and = bitmap_and_sve,
+	.or = bitmap_or_sve,
+	.andnot = bitmap_andnot_sve,
+	.intersects = bitmap_intersects_sve,
+	.subset = bitmap_subset_sve,
+	.equal = bitmap_equal_sve,
+	.weight = bitmap_weight_sve,
+};
+
+static int has_sve(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_SVE);
+}
+
+/* In order of preference */
+static const struct {
+	const struct bitmap_ops *ops;
+	int (*supported)(void);
+} bitmap_arch_ops[] = {
+	{ &bitmap_sve_ops,	has_sve },
+	{ &bitmap_neon_ops,	has_neon },
+	{ NULL, NULL },
+};
+
+const struct bitmap_ops *arch_bitmap_ops(const char *name)
+{
+	int i;
+
+	for (i = 0; bitmap_arch_ops[i].ops; ++i) {
+		if (name && strcmp(name, bitmap_arch_ops[i].ops->name))
+			continue;
+
+		if (bitmap_arch_ops[i].supported())
+			return bitmap_arch_ops[i].ops;
+	}
+
+	return NULL;
+}
+
+/* The nth variant the CPU supports, NULL past the last one */
+const struct bitmap_ops *arch_bitmap_ops_nth(int n)
+{
+	int i;
+
+	for (i = 0; bitmap_arch_ops[i].ops; ++i) {
+		if (bitmap_arch_ops[i].supported() && n-- == 0)
+			return bitmap_arch_ops[i].ops;
+	}
+
+	return NULL;
+}
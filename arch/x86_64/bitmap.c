@@ -0,0 +1,455 @@
+/*
+ * arch/x86_64/bitmap.c
+ * AVX2, AVX-512 and POPCNT variants of the bitmap word loops.
+ *
+ * Vectors cover the whole words of a bitmap, the remaining words and
+ * the trailing partial word are left to the generic code so that the
+ * result is identical to it. Functions are compiled for their target
+ * ISA through the target attribute, the rest of the program stays
+ * baseline x86_64.
+ */
+#include <types.h>
+#include <bitops.h>
+#include <bitmap.h>
+#include <immintrin.h>
+
+#define AVX2_WORDS	(256 / BITS_PER_LONG)
+#define AVX512_WORDS	(512 / BITS_PER_LONG)
+
+/* Number of words a vector loop of n words per vector covers */
+static inline int vector_words(int bits, int n)
+{
+	return (bits / (int)BITS_PER_LONG) & ~(n - 1);
+}
+
+#define TAIL_BITS(bits, k)	((bits) - (k) * (int)BITS_PER_LONG)
+
+/*
+ * AVX2
+ */
+#define __avx2	__attribute__((target("avx2")))
+
+__avx2
+static int bitmap_and_avx2(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+	__m256i acc = _mm256_setzero_si256();
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		__m256i r = _mm256_and_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k]));
+
+		_mm256_storeu_si256((__m256i *)&dst[k], r);
+		acc = _mm256_or_si256(acc, r);
+	}
+
+	return __bitmap_and_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | !_mm256_testz_si256(acc, acc);
+}
+
+__avx2
+static void bitmap_or_avx2(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		_mm256_storeu_si256((__m256i *)&dst[k], _mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k])));
+	}
+
+	__bitmap_or_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx2
+static int bitmap_andnot_avx2(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+	__m256i acc = _mm256_setzero_si256();
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		/* andnot complements its first operand */
+		__m256i r = _mm256_andnot_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k]));
+
+		_mm256_storeu_si256((__m256i *)&dst[k], r);
+		acc = _mm256_or_si256(acc, r);
+	}
+
+	return __bitmap_andnot_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | !_mm256_testz_si256(acc, acc);
+}
+
+__avx2
+static int bitmap_intersects_avx2(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		if (!_mm256_testz_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k])))
+			return 1;
+	}
+
+	return __bitmap_intersects_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx2
+static int bitmap_subset_avx2(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		/* testc: (~bitmap2 & bitmap1) == 0 */
+		if (!_mm256_testc_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k])))
+			return 0;
+	}
+
+	return __bitmap_subset_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx2
+static int bitmap_equal_avx2(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		__m256i x = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *)&bitmap1[k]),
+				_mm256_loadu_si256((const __m256i *)&bitmap2[k]));
+
+		if (!_mm256_testz_si256(x, x))
+			return 0;
+	}
+
+	return __bitmap_equal_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+/*
+ * Population count of each byte through a nibble lookup table,
+ * summed up into 64-bit lanes by psadbw.
+ */
+__avx2
+static int bitmap_weight_avx2(const unsigned long *bitmap, int bits)
+{
+	int k, lim = vector_words(bits, AVX2_WORDS);
+	const __m256i lookup = _mm256_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+
+	for (k = 0; k < lim; k += AVX2_WORDS) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&bitmap[k]);
+		__m256i lo = _mm256_and_si256(v, low_mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+		__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+				_mm256_shuffle_epi8(lookup, hi));
+
+		acc = _mm256_add_epi64(acc,
+				_mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			_mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+
+	return _mm_cvtsi128_si64(sum) +
+		__bitmap_weight_generic(bitmap + k, TAIL_BITS(bits, k));
+}
+
+static const struct bitmap_ops bitmap_avx2_ops = {
+	.name = "avx2",
+	.and = bitmap_and_avx2,
+	.or = bitmap_or_avx2,
+	.andnot = bitmap_andnot_avx2,
+	.intersects = bitmap_intersects_avx2,
+	.subset = bitmap_subset_avx2,
+	.equal = bitmap_equal_avx2,
+	.weight = bitmap_weight_avx2,
+};
+
+/*
+ * POPCNT, for CPUs without AVX2 only the weight is accelerated
+ */
+__attribute__((target("popcnt")))
+static int bitmap_weight_popcnt(const unsigned long *bitmap, int bits)
+{
+	int k, w = 0, lim = bits / BITS_PER_LONG;
+
+	for (k = 0; k < lim; k++)
+		w += __builtin_popcountl(bitmap[k]);
+
+	if (bits % BITS_PER_LONG)
+		w += __builtin_popcountl(bitmap[k] & BITMAP_LAST_WORD_MASK(bits));
+
+	return w;
+}
+
+static const struct bitmap_ops bitmap_popcnt_ops = {
+	.name = "popcnt",
+	.and = __bitmap_and_generic,
+	.or = __bitmap_or_generic,
+	.andnot = __bitmap_andnot_generic,
+	.intersects = __bitmap_intersects_generic,
+	.subset = __bitmap_subset_generic,
+	.equal = __bitmap_equal_generic,
+	.weight = bitmap_weight_popcnt,
+};
+
+/*
+ * AVX-512
+ */
+#define __avx512	__attribute__((target("avx512f,avx512bw")))
+#define __avx512_popcnt	__attribute__((target("avx512f,avx512vpopcntdq")))
+
+__avx512
+static int bitmap_and_avx512(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+	__m512i acc = _mm512_setzero_si512();
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		__m512i r = _mm512_and_si512(_mm512_loadu_si512(&bitmap1[k]),
+				_mm512_loadu_si512(&bitmap2[k]));
+
+		_mm512_storeu_si512(&dst[k], r);
+		acc = _mm512_or_si512(acc, r);
+	}
+
+	return __bitmap_and_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | !!_mm512_test_epi64_mask(acc, acc);
+}
+
+__avx512
+static void bitmap_or_avx512(unsigned long *dst, const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		_mm512_storeu_si512(&dst[k], _mm512_or_si512(
+				_mm512_loadu_si512(&bitmap1[k]),
+				_mm512_loadu_si512(&bitmap2[k])));
+	}
+
+	__bitmap_or_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx512
+static int bitmap_andnot_avx512(unsigned long *dst,
+		const unsigned long *bitmap1, const unsigned long *bitmap2,
+		int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+	__m512i acc = _mm512_setzero_si512();
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		__m512i r = _mm512_andnot_si512(_mm512_loadu_si512(&bitmap2[k]),
+				_mm512_loadu_si512(&bitmap1[k]));
+
+		_mm512_storeu_si512(&dst[k], r);
+		acc = _mm512_or_si512(acc, r);
+	}
+
+	return __bitmap_andnot_generic(dst + k, bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k)) | !!_mm512_test_epi64_mask(acc, acc);
+}
+
+__avx512
+static int bitmap_intersects_avx512(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		if (_mm512_test_epi64_mask(_mm512_loadu_si512(&bitmap1[k]),
+					_mm512_loadu_si512(&bitmap2[k])))
+			return 1;
+	}
+
+	return __bitmap_intersects_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx512
+static int bitmap_subset_avx512(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		__m512i x = _mm512_andnot_si512(_mm512_loadu_si512(&bitmap2[k]),
+				_mm512_loadu_si512(&bitmap1[k]));
+
+		if (_mm512_test_epi64_mask(x, x))
+			return 0;
+	}
+
+	return __bitmap_subset_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+__avx512
+static int bitmap_equal_avx512(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		if (_mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&bitmap1[k]),
+					_mm512_loadu_si512(&bitmap2[k])))
+			return 0;
+	}
+
+	return __bitmap_equal_generic(bitmap1 + k, bitmap2 + k,
+			TAIL_BITS(bits, k));
+}
+
+/* Same as the AVX2 variant, for CPUs without VPOPCNTQ */
+__avx512
+static int bitmap_weight_avx512(const unsigned long *bitmap, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+	const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+	const __m512i low_mask = _mm512_set1_epi8(0x0f);
+	__m512i acc = _mm512_setzero_si512();
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		__m512i v = _mm512_loadu_si512(&bitmap[k]);
+		__m512i lo = _mm512_and_si512(v, low_mask);
+		__m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+		__m512i cnt = _mm512_add_epi8(_mm512_shuffle_epi8(lookup, lo),
+				_mm512_shuffle_epi8(lookup, hi));
+
+		acc = _mm512_add_epi64(acc,
+				_mm512_sad_epu8(cnt, _mm512_setzero_si512()));
+	}
+
+	return _mm512_reduce_add_epi64(acc) +
+		__bitmap_weight_generic(bitmap + k, TAIL_BITS(bits, k));
+}
+
+__avx512_popcnt
+static int bitmap_weight_avx512_popcnt(const unsigned long *bitmap, int bits)
+{
+	int k, lim = vector_words(bits, AVX512_WORDS);
+	__m512i acc = _mm512_setzero_si512();
+
+	for (k = 0; k < lim; k += AVX512_WORDS) {
+		acc = _mm512_add_epi64(acc,
+				_mm512_popcnt_epi64(_mm512_loadu_si512(&bitmap[k])));
+	}
+
+	return _mm512_reduce_add_epi64(acc) +
+		__bitmap_weight_generic(bitmap + k, TAIL_BITS(bits, k));
+}
+
+static const struct bitmap_ops bitmap_avx512_popcnt_ops = {
+	.name = "avx512_vpopcnt",
+	.and = bitmap_and_avx512,
+	.or = bitmap_or_avx512,
+	.andnot = bitmap_andnot_avx512,
+	.intersects = bitmap_intersects_avx512,
+	.subset = bitmap_subset_avx512,
+	.equal = bitmap_equal_avx512,
+	.weight = bitmap_weight_avx512_popcnt,
+};
+
+static const struct bitmap_ops bitmap_avx512_ops = {
+	.name = "avx512",
+	.and = bitmap_and_avx512,
+	.or = bitmap_or_avx512,
+	.andnot = bitmap_andnot_avx512,
+	.intersects = bitmap_intersects_avx512,
+	.subset = bitmap_subset_avx512,
+	.equal = bitmap_equal_avx512,
+	.weight = bitmap_weight_avx512,
+};
+
+/* The other ops are the avx512 ones, which need avx512bw too */
+static int has_avx512_popcnt(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw") &&
+		__builtin_cpu_supports("avx512vpopcntdq");
+}
+
+static int has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+
+static int has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int has_popcnt(void)
+{
+	return __builtin_cpu_supports("popcnt");
+}
+
+/* In order of preference */
+static const struct {
+	const struct bitmap_ops *ops;
+	int (*supported)(void);
+} bitmap_arch_ops[] = {
+	{ &bitmap_avx512_popcnt_ops,	has_avx512_popcnt },
+	{ &bitmap_avx512_ops,		has_avx512 },
+	{ &bitmap_avx2_ops,		has_avx2 },
+	{ &bitmap_popcnt_ops,		has_popcnt },
+	{ NULL, NULL },
+};
+
+const struct bitmap_ops *arch_bitmap_ops(const char *name)
+{
+	int i;
+
+	__builtin_cpu_init();
+
+	for (i = 0; bitmap_arch_ops[i].ops; ++i) {
+		if (name && strcmp(name, bitmap_arch_ops[i].ops->name))
+			continue;
+
+		if (bitmap_arch_ops[i].supported())
+			return bitmap_arch_ops[i].ops;
+	}
+
+	return NULL;
+}
+
+/* The nth variant the CPU supports, NULL past the last one */
+const struct bitmap_ops *arch_bitmap_ops_nth(int n)
+{
+	int i;
+
+	__builtin_cpu_init();
+
+	for (i = 0; bitmap_arch_ops[i].ops; ++i) {
+		if (bitmap_arch_ops[i].supported() && n-- == 0)
+			return bitmap_arch_ops[i].ops;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,247 @@
+/*
+ * bench_bitmap: time the bitmap.c and bitops.c primitives placement
+ * decisions are built on, so that regressions can be tracked across
+ * commits.
+ *
+ * Random masks of 64 to MAX_BITS bits (powers of two) are generated at
+ * several densities, each operation is repeated until MIN_MS elapsed and
+ * the average time per operation is reported in CSV format. The impl
+ * column is the bitmap_ops table in use, MPIPIN_BITMAP_OPS selects
+ * another one. Where there are fixed width ops for the width, weight,
+ * and and equal are timed with those as well. Operations:
+ *
+ *   find_next_bit         walk all set bits of a mask
+ *   weight                __bitmap_weight()
+ *   and                   __bitmap_and() of two masks
+ *   equal                 __bitmap_equal() of a mask with itself
+ *   parse                 bitmap_parse() of the mask in sysfs hex format
+ *   parselist             bitmap_parselist() of the mask as a list
+ *   scnlistprintf         bitmap_scnlistprintf() of the mask
+ *   remap                 bitmap_remap() of a mask from one mask onto another
+ *   find_free_region      bitmap_find_free_region() of 4 bits and its
+ *                         release
+ *
+ * Usage: bench_bitmap [-m MAX_BITS] [-t MIN_MS] [-r RUNS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bench.h>
+#include <bitmap.h>
+
+/* Order of the regions allocated by find_free_region */
+#define REGION_ORDER 2
+
+struct bench_ctx {
+	int nbits;
+	unsigned long *src1;
+	unsigned long *src2;
+	unsigned long *dst;
+	char *hex;
+	char *list;
+	char *out;
+	int len;
+	const struct bitmap_ops *fixed;
+};
+
+static void bench_find_next_bit(struct bench_ctx *ctx)
+{
+	unsigned long sum = 0;
+	int bit;
+
+	for_each_set_bit(bit, ctx->src1, ctx->nbits)
+		sum += bit;
+	bench_sink = sum;
+}
+
+static void bench_weight(struct bench_ctx *ctx)
+{
+	bench_sink = __bitmap_weight(ctx->src1, ctx->nbits);
+}
+
+static void bench_and(struct bench_ctx *ctx)
+{
+	bench_sink = __bitmap_and(ctx->dst, ctx->src1, ctx->src2, ctx->nbits);
+}
+
+static void bench_equal(struct bench_ctx *ctx)
+{
+	bench_sink = __bitmap_equal(ctx->src1, ctx->src1, ctx->nbits);
+}
+
+static void bench_weight_fixed(struct bench_ctx *ctx)
+{
+	bench_sink = ctx->fixed->weight(ctx->src1, ctx->nbits);
+}
+
+static void bench_and_fixed(struct bench_ctx *ctx)
+{
+	bench_sink = ctx->fixed->and(ctx->dst, ctx->src1, ctx->src2, ctx->nbits);
+}
+
+static void bench_equal_fixed(struct bench_ctx *ctx)
+{
+	bench_sink = ctx->fixed->equal(ctx->src1, ctx->src1, ctx->nbits);
+}
+
+static void bench_parse(struct bench_ctx *ctx)
+{
+	bench_sink = bitmap_parse(ctx->hex, ctx->len, ctx->dst, ctx->nbits);
+}
+
+static void bench_parselist(struct bench_ctx *ctx)
+{
+	bench_sink = bitmap_parselist(ctx->list, ctx->dst, ctx->nbits);
+}
+
+static void bench_scnlistprintf(struct bench_ctx *ctx)
+{
+	bench_sink = bitmap_scnlistprintf(ctx->out, ctx->len, ctx->src1, ctx->nbits);
+}
+
+static void bench_remap(struct bench_ctx *ctx)
+{
+	bitmap_remap(ctx->dst, ctx->src1, ctx->src1, ctx->src2, ctx->nbits);
+}
+
+static void bench_find_free_region(struct bench_ctx *ctx)
+{
+	int pos;
+
+	pos = bitmap_find_free_region(ctx->src2, ctx->nbits, REGION_ORDER);
+	if (pos >= 0)
+		bitmap_release_region(ctx->src2, pos, REGION_ORDER);
+	bench_sink = pos;
+}
+
+struct bench {
+	const char *op;
+	void (*fn)(struct bench_ctx *ctx);
+	/* Timed with the fixed width ops */
+	int fixed;
+};
+
+static const struct bench benches[] = {
+	{ "find_next_bit",	bench_find_next_bit, 0 },
+	{ "weight",		bench_weight, 0 },
+	{ "weight",		bench_weight_fixed, 1 },
+	{ "and",		bench_and, 0 },
+	{ "and",		bench_and_fixed, 1 },
+	{ "equal",		bench_equal, 0 },
+	{ "equal",		bench_equal_fixed, 1 },
+	{ "parse",		bench_parse, 0 },
+	{ "parselist",		bench_parselist, 0 },
+	{ "scnlistprintf",	bench_scnlistprintf, 0 },
+	{ "remap",		bench_remap, 0 },
+	{ "find_free_region",	bench_find_free_region, 0 },
+	{ NULL, NULL, 0 },
+};
+
+/* Percentage of bits set */
+static const int densities[] = { 1, 10, 50, 90 };
+
+static void fill_random(unsigned long *mask, int nbits, int density,
+		unsigned long *state)
+{
+	int i;
+
+	bitmap_zero(mask, nbits);
+	for (i = 0; i < nbits; ++i) {
+		if ((int)(xorshift64(state) % 100) < density)
+			set_bit(i, mask);
+	}
+}
+
+/* Average ns per call, repeating fn until at least min_ns elapsed */
+static double time_op(const struct bench *b, struct bench_ctx *ctx,
+		unsigned long min_ns)
+{
+	unsigned long iterations = 1, i;
+	unsigned long start, elapsed;
+
+	for (;;) {
+		start = get_time_ns();
+		for (i = 0; i < iterations; ++i)
+			b->fn(ctx);
+		elapsed = get_time_ns() - start;
+
+		if (elapsed >= min_ns)
+			return (double)elapsed / iterations;
+
+		iterations *= 2;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	unsigned long state = BENCH_SEED;
+	int max_bits = 8192;
+	int min_ms = 10;
+	int runs = 3;
+	const struct bench_option options[] = {
+		{ 'm', "MAX_BITS", &max_bits },
+		{ 't', "MIN_MS", &min_ms },
+		{ 'r', "RUNS", &runs },
+		{ 0, NULL, NULL },
+	};
+	int d, i, run;
+
+	bench_options(argc, argv, options, NULL);
+
+	if (max_bits < 64 || min_ms <= 0) {
+		fprintf(stderr, "error: invalid arguments\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* "nnnnn," per other bit at worst for lists */
+	ctx.len = max_bits * 3 + 64;
+	ctx.src1 = calloc(BITS_TO_LONGS(max_bits), sizeof(unsigned long));
+	ctx.src2 = calloc(BITS_TO_LONGS(max_bits), sizeof(unsigned long));
+	ctx.dst = calloc(BITS_TO_LONGS(max_bits), sizeof(unsigned long));
+	ctx.hex = malloc(ctx.len);
+	ctx.list = malloc(ctx.len);
+	ctx.out = malloc(ctx.len);
+	if (!ctx.src1 || !ctx.src2 || !ctx.dst || !ctx.hex || !ctx.list ||
+			!ctx.out) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_csv_header("op,impl,bits,density,run,ns_per_op");
+	for (ctx.nbits = 64; ctx.nbits <= max_bits; ctx.nbits *= 2) {
+		ctx.fixed = bitmap_fixed_ops_for(ctx.nbits);
+		for (d = 0; d < (int)(sizeof(densities) / sizeof(densities[0]));
+				++d) {
+			fill_random(ctx.src1, ctx.nbits, densities[d], &state);
+			fill_random(ctx.src2, ctx.nbits, densities[d], &state);
+			bitmap_scnprintf(ctx.hex, ctx.len, ctx.src1, ctx.nbits);
+			bitmap_scnlistprintf(ctx.list, ctx.len, ctx.src1, ctx.nbits);
+
+			for (i = 0; benches[i].op; ++i) {
+				if (benches[i].fixed && !ctx.fixed)
+					continue;
+
+				for (run = 0; run < runs; ++run) {
+					bench_csv_row("bitmap,%s,%s,%d,%d,%d,%.1f\n",
+							benches[i].op, benches[i].fixed ?
+							ctx.fixed->name : bitmap_ops.name,
+							ctx.nbits, densities[d], run,
+							time_op(&benches[i], &ctx,
+								min_ms * 1000000UL));
+				}
+			}
+		}
+	}
+
+	free(ctx.out);
+	free(ctx.list);
+	free(ctx.hex);
+	free(ctx.dst);
+	free(ctx.src2);
+	free(ctx.src1);
+	return 0;
+}
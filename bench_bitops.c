@@ -0,0 +1,146 @@
+/*
+ * bench_bitops: compare the software bit operations of bitops.c with
+ * the compiler builtin and hardware instruction based ones.
+ *
+ * Each operation is applied to an array of pseudo random words (only
+ * nonzero ones for the scans, which are undefined for zero) and the
+ * average time per word is reported in CSV format. Implementations:
+ *
+ *   sw       __sw_hweight64(), __sw_fls() and __sw_ffs() of bitops.c
+ *   builtin  hweight_long(), fls(), __ffs() and ffz() as compiled for
+ *            this architecture
+ *   popcnt   __builtin_popcountl() compiled for POPCNT (x86_64, only if
+ *            the CPU supports it)
+ *
+ * Usage: bench_bitops [-n WORDS] [-r RUNS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bench.h>
+#include <bitops.h>
+
+/* Passes over the words per run */
+#define PASSES 64
+
+#define BENCH_LOOP(name, type, expr)					\
+static void bench_##name(const unsigned long *words, int nr)		\
+{									\
+	unsigned long sum = 0;						\
+	int i, pass;							\
+									\
+	for (pass = 0; pass < PASSES; ++pass) {				\
+		for (i = 0; i < nr; ++i) {				\
+			type x = (type)words[i];			\
+			sum += (expr);					\
+		}							\
+	}								\
+	bench_sink = sum;							\
+}
+
+BENCH_LOOP(hweight_sw, unsigned long, __sw_hweight64(x))
+BENCH_LOOP(hweight_builtin, unsigned long, hweight_long(x))
+BENCH_LOOP(fls_sw, int, __sw_fls(x))
+BENCH_LOOP(fls_builtin, int, fls(x))
+BENCH_LOOP(ffs_sw, unsigned long, __sw_ffs(x))
+BENCH_LOOP(ffs_builtin, unsigned long, __ffs(x))
+BENCH_LOOP(ffz_sw, unsigned long, __sw_ffs(~x))
+BENCH_LOOP(ffz_builtin, unsigned long, ffz(x))
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+BENCH_LOOP(hweight_popcnt, unsigned long, __builtin_popcountl(x))
+
+static int has_popcnt(void)
+{
+	return __builtin_cpu_supports("popcnt");
+}
+#endif
+
+struct bench {
+	const char *op;
+	const char *impl;
+	void (*fn)(const unsigned long *words, int nr);
+	/* Words with all bits set are invalid input */
+	int no_ones;
+};
+
+static const struct bench benches[] = {
+	{ "hweight", "sw",	bench_hweight_sw, 0 },
+	{ "hweight", "builtin",	bench_hweight_builtin, 0 },
+#if defined(__x86_64__)
+	{ "hweight", "popcnt",	bench_hweight_popcnt, 0 },
+#endif
+	{ "fls", "sw",		bench_fls_sw, 0 },
+	{ "fls", "builtin",	bench_fls_builtin, 0 },
+	{ "ffs", "sw",		bench_ffs_sw, 0 },
+	{ "ffs", "builtin",	bench_ffs_builtin, 0 },
+	{ "ffz", "sw",		bench_ffz_sw, 1 },
+	{ "ffz", "builtin",	bench_ffz_builtin, 1 },
+	{ NULL, NULL, NULL, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long *words, *words_no_ones;
+	unsigned long state = BENCH_SEED;
+	unsigned long start, elapsed;
+	int nr_words = 4096;
+	int runs = 5;
+	const struct bench_option options[] = {
+		{ 'n', "WORDS", &nr_words },
+		{ 'r', "RUNS", &runs },
+		{ 0, NULL, NULL },
+	};
+	int i, run;
+
+	bench_options(argc, argv, options, NULL);
+
+	if (nr_words <= 0) {
+		fprintf(stderr, "error: invalid number of words\n");
+		exit(EXIT_FAILURE);
+	}
+
+	words = malloc(sizeof(*words) * nr_words);
+	words_no_ones = malloc(sizeof(*words) * nr_words);
+	if (!words || !words_no_ones) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Vary the number of bits set, so that branchy code isn't favored */
+	for (i = 0; i < nr_words; ++i) {
+		unsigned long w = xorshift64(&state);
+
+		w >>= xorshift64(&state) % BITS_PER_LONG;
+		w <<= xorshift64(&state) % BITS_PER_LONG;
+		words[i] = w ? w : 1;
+		words_no_ones[i] = ~words[i] ? words[i] : 0;
+	}
+
+	bench_csv_header("op,impl,run,ns_per_word");
+	for (i = 0; benches[i].op; ++i) {
+#if defined(__x86_64__)
+		if (benches[i].fn == bench_hweight_popcnt && !has_popcnt())
+			continue;
+#endif
+
+		for (run = 0; run < runs; ++run) {
+			start = get_time_ns();
+			benches[i].fn(benches[i].no_ones ? words_no_ones : words,
+					nr_words);
+			elapsed = get_time_ns() - start;
+
+			bench_csv_row("bitops,%s,%s,%d,%.3f\n", benches[i].op,
+					benches[i].impl, run,
+					(double)elapsed / ((double)nr_words * PASSES));
+		}
+	}
+
+	free(words_no_ones);
+	free(words);
+	return 0;
+}
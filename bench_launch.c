@@ -0,0 +1,191 @@
+/*
+ * bench_launch: measure mpipin's startup for increasing number of
+ * processes per node.
+ *
+ * Forks PPN dummy ranks running "mpipin -p PPN --trace=DIR true" under
+ * the same parent, as an MPI launcher would, and reports in CSV format:
+ *
+ *   usec          from the first fork until the last rank exited, which
+ *                 is dominated by fork and exec
+ *   slot_usec     the longest any rank took from attaching the segment to
+ *                 having its slot filled in (trace phases shm_attach to
+ *                 arrival)
+ *   ranking_usec  the last rank's wait for all slots and the sort giving
+ *                 out ranks (arrival to ranked)
+ *
+ * Usage: bench_launch [-m MAX_PPN] [-r RUNS] [path to mpipin]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <bench.h>
+
+struct phases {
+	unsigned long slot_ns;
+	unsigned long ranking_ns;
+};
+
+/* Index of a column of the trace header, -1 if missing */
+static int trace_column(char *header, const char *name)
+{
+	char *field, *save;
+	int i = 0;
+
+	for (field = strtok_r(header, ",\n", &save); field;
+			field = strtok_r(NULL, ",\n", &save), ++i) {
+		if (!strcmp(field, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Read the phases of a launch from the trace of the node and remove it
+ * for the next launch.
+ */
+static int read_phases(const char *path, struct phases *phases)
+{
+	char line[1024], header[1024];
+	unsigned long ts[64];
+	int attach, arrival, ranked;
+	char *field, *save;
+	int nr, ret = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (!fgets(line, sizeof(line), f))
+		goto out;
+
+	strcpy(header, line);
+	attach = trace_column(header, "shm_attach");
+	strcpy(header, line);
+	arrival = trace_column(header, "arrival");
+	strcpy(header, line);
+	ranked = trace_column(header, "ranked");
+	if (attach < 0 || arrival < 0 || ranked < 0)
+		goto out;
+
+	phases->slot_ns = phases->ranking_ns = 0;
+	while (fgets(line, sizeof(line), f)) {
+		nr = 0;
+		for (field = strtok_r(line, ",\n", &save); field && nr < 64;
+				field = strtok_r(NULL, ",\n", &save))
+			ts[nr++] = strtoul(field, NULL, 10);
+
+		if (nr <= attach || nr <= arrival || nr <= ranked)
+			goto out;
+
+		if (ts[arrival] - ts[attach] > phases->slot_ns)
+			phases->slot_ns = ts[arrival] - ts[attach];
+
+		/* Only the last rank to arrive ranks the others */
+		if (ts[ranked])
+			phases->ranking_ns = ts[ranked] - ts[arrival];
+	}
+	ret = 0;
+
+out:
+	fclose(f);
+	unlink(path);
+	return ret;
+}
+
+static int launch(const char *mpipin, const char *trace, int ppn,
+		unsigned long *elapsed)
+{
+	char ppn_str[16];
+	unsigned long start;
+	int failed = 0;
+	int status;
+	int i;
+
+	snprintf(ppn_str, sizeof(ppn_str), "%d", ppn);
+
+	start = get_time_ns();
+	for (i = 0; i < ppn; ++i) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return -1;
+		}
+
+		if (pid == 0) {
+			execl(mpipin, mpipin, "-p", ppn_str, trace, "true", NULL);
+			_exit(127);
+		}
+	}
+
+	for (i = 0; i < ppn; ++i) {
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0)
+			++failed;
+	}
+	*elapsed = get_time_ns() - start;
+
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mpipin = "./mpipin";
+	char dir[] = "/tmp/bench_launch.XXXXXX";
+	char trace[PATH_MAX], path[PATH_MAX];
+	char host[256];
+	struct phases phases;
+	unsigned long elapsed;
+	int max_ppn = 1024;
+	int runs = 5;
+	const struct bench_option options[] = {
+		{ 'm', "MAX_PPN", &max_ppn },
+		{ 'r', "RUNS", &runs },
+		{ 0, NULL, NULL },
+	};
+	int ppn, run;
+
+	bench_options(argc, argv, options, "[mpipin]");
+
+	if (optind < argc)
+		mpipin = argv[optind];
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+
+	gethostname(host, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+	snprintf(trace, sizeof(trace), "--trace=%s", dir);
+	snprintf(path, sizeof(path), "%s/mpipin.%s.csv", dir, host);
+
+	bench_csv_header("ppn,run,usec,slot_usec,ranking_usec");
+	for (ppn = 2; ppn <= max_ppn; ppn *= 2) {
+		for (run = 0; run < runs; ++run) {
+			if (launch(mpipin, trace, ppn, &elapsed) < 0 ||
+					read_phases(path, &phases) < 0) {
+				fprintf(stderr, "error: launching %d processes\n", ppn);
+				unlink(path);
+				rmdir(dir);
+				exit(EXIT_FAILURE);
+			}
+
+			bench_csv_row("launch,%d,%d,%lu,%lu,%lu\n", ppn, run,
+					elapsed / 1000, phases.slot_ns / 1000,
+					phases.ranking_ns / 1000);
+		}
+	}
+
+	rmdir(dir);
+	return 0;
+}
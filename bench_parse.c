@@ -0,0 +1,144 @@
+/*
+ * bench_parse: compare the sysfs mask parsers of bitmap.c with the
+ * reference implementations they replaced.
+ *
+ * Random masks of the given width and density are printed in the two
+ * formats sysfs uses, comma-grouped hex (shared_cpu_map, core_siblings)
+ * and lists (cpulist, online), parsed back by both implementations and
+ * the average time per parse is reported in CSV format:
+ *
+ *   hex   __bitmap_parse() vs. __bitmap_parse_bytewise()
+ *   list  bitmap_parselist() vs. __bitmap_parselist_bitwise()
+ *
+ * Both results are checked against the original mask.
+ *
+ * Usage: bench_parse [-b BITS] [-r RUNS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bench.h>
+#include <bitmap.h>
+
+/* Parses per run */
+#define ITERATIONS 2000
+
+static int parse_hex(const char *buf, unsigned long *mask, int nbits)
+{
+	return __bitmap_parse(buf, strlen(buf) + 1, mask, nbits);
+}
+
+static int parse_hex_bytewise(const char *buf, unsigned long *mask, int nbits)
+{
+	return __bitmap_parse_bytewise(buf, strlen(buf) + 1, mask, nbits);
+}
+
+static int parse_list(const char *buf, unsigned long *mask, int nbits)
+{
+	return bitmap_parselist(buf, mask, nbits);
+}
+
+static int parse_list_bitwise(const char *buf, unsigned long *mask, int nbits)
+{
+	return __bitmap_parselist_bitwise(buf, strlen(buf), mask, nbits);
+}
+
+struct bench {
+	const char *format;
+	const char *impl;
+	int (*fn)(const char *buf, unsigned long *mask, int nbits);
+};
+
+static const struct bench benches[] = {
+	{ "hex", "bytewise",	parse_hex_bytewise },
+	{ "hex", "word",	parse_hex },
+	{ "list", "bitwise",	parse_list_bitwise },
+	{ "list", "word",	parse_list },
+	{ NULL, NULL, NULL },
+};
+
+/* Percentage of bits set, 100 being a single range for lists */
+static const int densities[] = { 1, 50, 100 };
+
+int main(int argc, char **argv)
+{
+	unsigned long *mask, *parsed;
+	unsigned long state = BENCH_SEED;
+	unsigned long start, elapsed;
+	char *hex, *list;
+	int nbits = 4096;
+	int runs = 5;
+	const struct bench_option options[] = {
+		{ 'b', "BITS", &nbits },
+		{ 'r', "RUNS", &runs },
+		{ 0, NULL, NULL },
+	};
+	int len;
+	int d, i, j, run;
+
+	bench_options(argc, argv, options, NULL);
+
+	if (nbits <= 0) {
+		fprintf(stderr, "error: invalid number of bits\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* "nnnnn," per other bit at worst for lists */
+	len = nbits * 3 + 64;
+	mask = calloc(BITS_TO_LONGS(nbits), sizeof(*mask));
+	parsed = calloc(BITS_TO_LONGS(nbits), sizeof(*parsed));
+	hex = malloc(len);
+	list = malloc(len);
+	if (!mask || !parsed || !hex || !list) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_csv_header("format,impl,bits,density,run,ns_per_parse");
+	for (d = 0; d < (int)(sizeof(densities) / sizeof(densities[0])); ++d) {
+		bitmap_zero(mask, nbits);
+		for (j = 0; j < nbits; ++j) {
+			if ((int)(xorshift64(&state) % 100) < densities[d])
+				set_bit(j, mask);
+		}
+
+		/* The reference list parser takes "" for CPU 0 */
+		if (bitmap_empty(mask, nbits))
+			set_bit(0, mask);
+
+		bitmap_scnprintf(hex, len, mask, nbits);
+		bitmap_scnlistprintf(list, len, mask, nbits);
+
+		for (i = 0; benches[i].format; ++i) {
+			const char *buf = benches[i].format[0] == 'h' ? hex : list;
+
+			if (benches[i].fn(buf, parsed, nbits) ||
+					!bitmap_equal(mask, parsed, nbits)) {
+				fprintf(stderr, "error: %s %s parse mismatch\n",
+						benches[i].format, benches[i].impl);
+				exit(EXIT_FAILURE);
+			}
+
+			for (run = 0; run < runs; ++run) {
+				start = get_time_ns();
+				for (j = 0; j < ITERATIONS; ++j)
+					benches[i].fn(buf, parsed, nbits);
+				elapsed = get_time_ns() - start;
+
+				bench_csv_row("parse,%s,%s,%d,%d,%d,%.1f\n",
+						benches[i].format, benches[i].impl,
+						nbits, densities[d], run,
+						(double)elapsed / ITERATIONS);
+			}
+		}
+	}
+
+	free(list);
+	free(hex);
+	free(parsed);
+	free(mask);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * bench_wake: measure the latency of waking up all ranks waiting for
+ * the plan of the rendezvous.
+ *
+ * Forks PPN - 1 waiters sharing an anonymous mapping with the parent,
+ * which publishes a new generation once everyone is waiting and wakes
+ * them all up. Each waiter records the time from the publication until
+ * it returned from waiting. Two primitives are compared:
+ *
+ *   condvar  PROCESS_SHARED mutex and condition variable with a
+ *            CLOCK_REALTIME deadline (the original rendezvous)
+ *   futex    futex on the generation word with a bounded spin phase
+ *            and a CLOCK_MONOTONIC timeout (what mpipin uses now)
+ *
+ * Latency percentiles over all waiters of all runs are reported in CSV
+ * format.
+ *
+ * Usage: bench_wake [-m MAX_PPN] [-r RUNS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <bench.h>
+#include <futex.h>
+
+#define MAX_PPN 1024
+#define TIMEOUT_MS 10000L
+#define SPIN_NS 200000L
+
+enum method {
+	METHOD_CONDVAR,
+	METHOD_FUTEX,
+};
+
+static const char *method_names[] = { "condvar", "futex" };
+
+struct shared {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int generation;
+	int nr_waiting;
+	unsigned long publish_ts;
+	unsigned long latency[MAX_PPN];
+};
+
+static void wait_condvar(struct shared *sh, int generation)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += TIMEOUT_MS / 1000;
+
+	pthread_mutex_lock(&sh->lock);
+	__atomic_add_fetch(&sh->nr_waiting, 1, __ATOMIC_RELEASE);
+	while (sh->generation == generation) {
+		if (pthread_cond_timedwait(&sh->cond, &sh->lock, &deadline))
+			break;
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static void wait_futex(struct shared *sh, int generation, long spin_ns)
+{
+	__atomic_add_fetch(&sh->nr_waiting, 1, __ATOMIC_RELEASE);
+	futex_wait_change(&sh->generation, generation, spin_ns, TIMEOUT_MS);
+}
+
+static void publish(struct shared *sh, enum method method)
+{
+	switch (method) {
+		case METHOD_CONDVAR:
+			pthread_mutex_lock(&sh->lock);
+			sh->publish_ts = get_time_ns();
+			++sh->generation;
+			pthread_cond_broadcast(&sh->cond);
+			pthread_mutex_unlock(&sh->lock);
+			break;
+
+		case METHOD_FUTEX:
+			sh->publish_ts = get_time_ns();
+			__atomic_add_fetch(&sh->generation, 1, __ATOMIC_RELEASE);
+			futex_wake_all(&sh->generation);
+			break;
+	}
+}
+
+static int run(struct shared *sh, enum method method, int ppn,
+		unsigned long *latency)
+{
+	long spin_ns = ppn <= get_nprocs() ? SPIN_NS : 0;
+	int generation = sh->generation;
+	int failed = 0;
+	int status;
+	int i;
+
+	sh->nr_waiting = 0;
+	for (i = 0; i < ppn - 1; ++i) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return -1;
+		}
+
+		if (pid == 0) {
+			if (method == METHOD_CONDVAR)
+				wait_condvar(sh, generation);
+			else
+				wait_futex(sh, generation, spin_ns);
+
+			sh->latency[i] = get_time_ns() -
+				__atomic_load_n(&sh->publish_ts, __ATOMIC_ACQUIRE);
+			_exit(sh->generation == generation);
+		}
+	}
+
+	/* The last rank arrives once everyone else is waiting */
+	while (__atomic_load_n(&sh->nr_waiting, __ATOMIC_ACQUIRE) < ppn - 1)
+		sched_yield();
+
+	publish(sh, method);
+
+	for (i = 0; i < ppn - 1; ++i) {
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0)
+			++failed;
+	}
+
+	memcpy(latency, sh->latency, sizeof(*latency) * (ppn - 1));
+	return failed ? -1 : 0;
+}
+
+static int ulong_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(unsigned long *sorted, int nr, int p)
+{
+	return sorted[(long)(nr - 1) * p / 100];
+}
+
+int main(int argc, char **argv)
+{
+	pthread_mutexattr_t lock_attr;
+	pthread_condattr_t cond_attr;
+	unsigned long *latency;
+	struct shared *sh;
+	int max_ppn = MAX_PPN;
+	int runs = 5;
+	const struct bench_option options[] = {
+		{ 'm', "MAX_PPN", &max_ppn },
+		{ 'r', "RUNS", &runs },
+		{ 0, NULL, NULL },
+	};
+	int method;
+	int ppn, r, nr;
+
+	bench_options(argc, argv, options, NULL);
+
+	if (max_ppn > MAX_PPN)
+		max_ppn = MAX_PPN;
+
+	sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	latency = malloc(sizeof(*latency) * MAX_PPN * runs);
+	if (sh == MAP_FAILED || !latency) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutexattr_init(&lock_attr);
+	pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&sh->lock, &lock_attr);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&sh->cond, &cond_attr);
+
+	bench_csv_header("method,ppn,p50_usec,p90_usec,p99_usec,max_usec");
+	for (ppn = 8; ppn <= max_ppn; ppn *= 2) {
+		for (method = METHOD_CONDVAR; method <= METHOD_FUTEX; ++method) {
+			nr = 0;
+			for (r = 0; r < runs; ++r) {
+				if (run(sh, method, ppn, latency + nr) < 0) {
+					fprintf(stderr, "error: %s: waking %d processes\n",
+							method_names[method], ppn);
+					exit(EXIT_FAILURE);
+				}
+				nr += ppn - 1;
+			}
+
+			qsort(latency, nr, sizeof(*latency), ulong_cmp);
+			bench_csv_row("wake,%s,%d,%lu,%lu,%lu,%lu\n", method_names[method], ppn,
+					percentile(latency, nr, 50) / 1000,
+					percentile(latency, nr, 90) / 1000,
+					percentile(latency, nr, 99) / 1000,
+					latency[nr - 1] / 1000);
+		}
+	}
+
+	return 0;
+}
@@ -16,6 +16,7 @@
 #define BUG_ON(x)
 
 #include <stdio.h>
+#include <stdlib.h>
 #define scnprintf snprintf
 
 /**
@@ -36,6 +37,46 @@ int hex_to_bin(char ch)
 }
 EXPORT_SYMBOL(hex_to_bin);
 
+/* Bytes of x (each below 0x80) in the range [lo, hi] get their top bit set */
+#define bytes_between(x, lo, hi)					\
+	((((x) + BYTES(0x80 - (lo))) & ~((x) + BYTES(0x7f - (hi))))	\
+	 & BYTES(0x80))
+#define BYTES(c)	(0x0101010101010101ULL * (c))
+
+/**
+ * hex8_to_bin - convert eight hex digits to their value
+ * @src: eight ASCII hex digits, the most significant one first
+ * @dst: the resulting value
+ *
+ * All the digits are validated and converted at once, eight per 64-bit
+ * word. Returns -EINVAL if any of them isn't a hex digit.
+ */
+static int hex8_to_bin(const char *src, u32 *dst)
+{
+	uint64_t x, digit, alpha;
+
+	memcpy(&x, src, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	if (x & BYTES(0x80))
+		return -EINVAL;
+
+	digit = bytes_between(x, '0', '9');
+	alpha = bytes_between(x | BYTES(0x20), 'a', 'f');
+	if ((digit | alpha) != BYTES(0x80))
+		return -EINVAL;
+
+	/* One nibble per byte, the first digit in the lowest byte */
+	x = (x & BYTES(0x0f)) + (alpha >> 7) * 9;
+
+	/* Pack them, the first digit becoming the most significant */
+	x = ((x << 4) | (x >> 8)) & 0x00ff00ff00ff00ffULL;
+	x = ((x << 8) | (x >> 16)) & 0x0000ffff0000ffffULL;
+	*dst = (u32)((x << 16) | (x >> 32));
+	return 0;
+}
+
 /*
  * bitmaps provide an array of bits, implemented using an an
  * array of unsigned longs.  The number of valid bits in a
@@ -92,7 +133,7 @@ int __bitmap_full(const unsigned long *bitmap, int bits)
 }
 EXPORT_SYMBOL(__bitmap_full);
 
-int __bitmap_equal(const unsigned long *bitmap1,
+int __bitmap_equal_generic(const unsigned long *bitmap1,
 		const unsigned long *bitmap2, int bits)
 {
 	int k, lim = bits/BITS_PER_LONG;
@@ -106,7 +147,7 @@ int __bitmap_equal(const unsigned long *bitmap1,
 
 	return 1;
 }
-EXPORT_SYMBOL(__bitmap_equal);
+EXPORT_SYMBOL(__bitmap_equal_generic);
 
 void __bitmap_complement(unsigned long *dst, const unsigned long *src, int bits)
 {
@@ -203,7 +244,7 @@ void __bitmap_shift_left(unsigned long *dst,
 }
 EXPORT_SYMBOL(__bitmap_shift_left);
 
-int __bitmap_and(unsigned long *dst, const unsigned long *bitmap1,
+int __bitmap_and_generic(unsigned long *dst, const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
 {
 	int k;
@@ -214,9 +255,9 @@ int __bitmap_and(unsigned long *dst, const unsigned long *bitmap1,
 		result |= (dst[k] = bitmap1[k] & bitmap2[k]);
 	return result != 0;
 }
-EXPORT_SYMBOL(__bitmap_and);
+EXPORT_SYMBOL(__bitmap_and_generic);
 
-void __bitmap_or(unsigned long *dst, const unsigned long *bitmap1,
+void __bitmap_or_generic(unsigned long *dst, const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
 {
 	int k;
@@ -225,7 +266,7 @@ void __bitmap_or(unsigned long *dst, const unsigned long *bitmap1,
 	for (k = 0; k < nr; k++)
 		dst[k] = bitmap1[k] | bitmap2[k];
 }
-EXPORT_SYMBOL(__bitmap_or);
+EXPORT_SYMBOL(__bitmap_or_generic);
 
 void __bitmap_xor(unsigned long *dst, const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
@@ -238,7 +279,7 @@ void __bitmap_xor(unsigned long *dst, const unsigned long *bitmap1,
 }
 EXPORT_SYMBOL(__bitmap_xor);
 
-int __bitmap_andnot(unsigned long *dst, const unsigned long *bitmap1,
+int __bitmap_andnot_generic(unsigned long *dst, const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
 {
 	int k;
@@ -249,9 +290,9 @@ int __bitmap_andnot(unsigned long *dst, const unsigned long *bitmap1,
 		result |= (dst[k] = bitmap1[k] & ~bitmap2[k]);
 	return result != 0;
 }
-EXPORT_SYMBOL(__bitmap_andnot);
+EXPORT_SYMBOL(__bitmap_andnot_generic);
 
-int __bitmap_intersects(const unsigned long *bitmap1,
+int __bitmap_intersects_generic(const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
 {
 	int k, lim = bits/BITS_PER_LONG;
@@ -264,9 +305,9 @@ int __bitmap_intersects(const unsigned long *bitmap1,
 			return 1;
 	return 0;
 }
-EXPORT_SYMBOL(__bitmap_intersects);
+EXPORT_SYMBOL(__bitmap_intersects_generic);
 
-int __bitmap_subset(const unsigned long *bitmap1,
+int __bitmap_subset_generic(const unsigned long *bitmap1,
 				const unsigned long *bitmap2, int bits)
 {
 	int k, lim = bits/BITS_PER_LONG;
@@ -279,9 +320,9 @@ int __bitmap_subset(const unsigned long *bitmap1,
 			return 0;
 	return 1;
 }
-EXPORT_SYMBOL(__bitmap_subset);
+EXPORT_SYMBOL(__bitmap_subset_generic);
 
-int __bitmap_weight(const unsigned long *bitmap, int bits)
+int __bitmap_weight_generic(const unsigned long *bitmap, int bits)
 {
 	int k, w = 0, lim = bits/BITS_PER_LONG;
 
@@ -293,6 +334,276 @@ int __bitmap_weight(const unsigned long *bitmap, int bits)
 
 	return w;
 }
+EXPORT_SYMBOL(__bitmap_weight_generic);
+
+const struct bitmap_ops bitmap_generic_ops = {
+	.name = "scalar",
+	.and = __bitmap_and_generic,
+	.or = __bitmap_or_generic,
+	.andnot = __bitmap_andnot_generic,
+	.intersects = __bitmap_intersects_generic,
+	.subset = __bitmap_subset_generic,
+	.equal = __bitmap_equal_generic,
+	.weight = __bitmap_weight_generic,
+};
+
+struct bitmap_ops bitmap_ops = {
+	.name = "scalar",
+	.and = __bitmap_and_generic,
+	.or = __bitmap_or_generic,
+	.andnot = __bitmap_andnot_generic,
+	.intersects = __bitmap_intersects_generic,
+	.subset = __bitmap_subset_generic,
+	.equal = __bitmap_equal_generic,
+	.weight = __bitmap_weight_generic,
+};
+
+/**
+ * bitmap_select_ops - select the implementation of the bitmap word loops
+ * @name: name of the implementation, NULL for the fastest one supported
+ *
+ * Returns 0 on success, -EINVAL if the CPU doesn't support the requested
+ * implementation, in which case the current one is kept.
+ */
+int bitmap_select_ops(const char *name)
+{
+	const struct bitmap_ops *ops;
+
+	if (name && !strcmp(name, bitmap_generic_ops.name))
+		ops = &bitmap_generic_ops;
+	else
+		ops = arch_bitmap_ops(name);
+
+	if (!ops) {
+		if (name)
+			return -EINVAL;
+		ops = &bitmap_generic_ops;
+	}
+
+	bitmap_ops = *ops;
+	return 0;
+}
+EXPORT_SYMBOL(bitmap_select_ops);
+
+__attribute__((constructor))
+static void bitmap_init_ops(void)
+{
+	if (bitmap_select_ops(getenv("MPIPIN_BITMAP_OPS")) < 0)
+		bitmap_select_ops(NULL);
+}
+
+/*
+ * Fully unrolled word loops for a width of nwords words. The bits
+ * argument is ignored, bits beyond the width must be zero in all
+ * operands, as they are in cpumasks, so the last word needs no masking.
+ */
+#define BITMAP_FIXED_OPS(nwords)					\
+static int __bitmap_and_##nwords(unsigned long *dst,			\
+		const unsigned long *bitmap1,				\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	unsigned long result = 0;					\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		result |= (dst[k] = bitmap1[k] & bitmap2[k]);		\
+	return result != 0;						\
+}									\
+									\
+static void __bitmap_or_##nwords(unsigned long *dst,			\
+		const unsigned long *bitmap1,				\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		dst[k] = bitmap1[k] | bitmap2[k];			\
+}									\
+									\
+static int __bitmap_andnot_##nwords(unsigned long *dst,		\
+		const unsigned long *bitmap1,				\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	unsigned long result = 0;					\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		result |= (dst[k] = bitmap1[k] & ~bitmap2[k]);		\
+	return result != 0;						\
+}									\
+									\
+static int __bitmap_intersects_##nwords(const unsigned long *bitmap1,	\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	unsigned long result = 0;					\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		result |= bitmap1[k] & bitmap2[k];			\
+	return result != 0;						\
+}									\
+									\
+static int __bitmap_subset_##nwords(const unsigned long *bitmap1,	\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	unsigned long result = 0;					\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		result |= bitmap1[k] & ~bitmap2[k];			\
+	return result == 0;						\
+}									\
+									\
+static int __bitmap_equal_##nwords(const unsigned long *bitmap1,	\
+		const unsigned long *bitmap2, int bits)			\
+{									\
+	unsigned long result = 0;					\
+	int k;								\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		result |= bitmap1[k] ^ bitmap2[k];			\
+	return result == 0;						\
+}									\
+									\
+static int __bitmap_weight_##nwords(const unsigned long *bitmap,	\
+		int bits)						\
+{									\
+	int k, w = 0;							\
+									\
+	(void)bits;							\
+	_Pragma("GCC unroll 64")					\
+	for (k = 0; k < nwords; k++)					\
+		w += hweight_long(bitmap[k]);				\
+	return w;							\
+}									\
+									\
+static const struct bitmap_ops bitmap_fixed_ops_##nwords = {		\
+	.name = "fixed" #nwords,					\
+	.and = __bitmap_and_##nwords,					\
+	.or = __bitmap_or_##nwords,					\
+	.andnot = __bitmap_andnot_##nwords,				\
+	.intersects = __bitmap_intersects_##nwords,			\
+	.subset = __bitmap_subset_##nwords,				\
+	.equal = __bitmap_equal_##nwords,				\
+	.weight = __bitmap_weight_##nwords,				\
+}
+
+BITMAP_FIXED_OPS(1);
+BITMAP_FIXED_OPS(2);
+BITMAP_FIXED_OPS(4);
+BITMAP_FIXED_OPS(8);
+BITMAP_FIXED_OPS(16);
+BITMAP_FIXED_OPS(64);
+
+static const struct {
+	int nwords;
+	const struct bitmap_ops *ops;
+} bitmap_fixed_ops[] = {
+	{ 1, &bitmap_fixed_ops_1 },
+	{ 2, &bitmap_fixed_ops_2 },
+	{ 4, &bitmap_fixed_ops_4 },
+	{ 8, &bitmap_fixed_ops_8 },
+	{ 16, &bitmap_fixed_ops_16 },
+	{ 64, &bitmap_fixed_ops_64 },
+	{ 0, NULL },
+};
+
+/**
+ * bitmap_fixed_width - round a width up to one with fixed width ops
+ * @nbits: number of bits
+ *
+ * Returns the width in bits, or @nbits if it is too wide for any.
+ */
+int bitmap_fixed_width(int nbits)
+{
+	int i;
+
+	for (i = 0; bitmap_fixed_ops[i].ops; ++i) {
+		if ((int)BITS_TO_LONGS(nbits) <= bitmap_fixed_ops[i].nwords)
+			return bitmap_fixed_ops[i].nwords * BITS_PER_LONG;
+	}
+
+	return nbits;
+}
+EXPORT_SYMBOL(bitmap_fixed_width);
+
+/**
+ * bitmap_fixed_ops_for - fixed width ops of a width
+ * @nbits: width in bits, as returned by bitmap_fixed_width()
+ *
+ * Returns NULL if there are none for @nbits.
+ */
+const struct bitmap_ops *bitmap_fixed_ops_for(int nbits)
+{
+	int i;
+
+	for (i = 0; bitmap_fixed_ops[i].ops; ++i) {
+		if (nbits == (int)(bitmap_fixed_ops[i].nwords * BITS_PER_LONG))
+			return bitmap_fixed_ops[i].ops;
+	}
+
+	return NULL;
+}
+EXPORT_SYMBOL(bitmap_fixed_ops_for);
+
+int __bitmap_equal(const unsigned long *bitmap1,
+		const unsigned long *bitmap2, int bits)
+{
+	return bitmap_ops.equal(bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_equal);
+
+int __bitmap_and(unsigned long *dst, const unsigned long *bitmap1,
+				const unsigned long *bitmap2, int bits)
+{
+	return bitmap_ops.and(dst, bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_and);
+
+void __bitmap_or(unsigned long *dst, const unsigned long *bitmap1,
+				const unsigned long *bitmap2, int bits)
+{
+	bitmap_ops.or(dst, bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_or);
+
+int __bitmap_andnot(unsigned long *dst, const unsigned long *bitmap1,
+				const unsigned long *bitmap2, int bits)
+{
+	return bitmap_ops.andnot(dst, bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_andnot);
+
+int __bitmap_intersects(const unsigned long *bitmap1,
+				const unsigned long *bitmap2, int bits)
+{
+	return bitmap_ops.intersects(bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_intersects);
+
+int __bitmap_subset(const unsigned long *bitmap1,
+				const unsigned long *bitmap2, int bits)
+{
+	return bitmap_ops.subset(bitmap1, bitmap2, bits);
+}
+EXPORT_SYMBOL(__bitmap_subset);
+
+int __bitmap_weight(const unsigned long *bitmap, int bits)
+{
+	return bitmap_ops.weight(bitmap, bits);
+}
 EXPORT_SYMBOL(__bitmap_weight);
 
 void bitmap_set(unsigned long *map, int start, int nr)
@@ -447,6 +758,85 @@ EXPORT_SYMBOL(bitmap_scnprintf);
 int __bitmap_parse(const char *buf, unsigned int buflen,
 		unsigned long *maskp,
 		int nmaskbits)
+{
+	const char *start = buf, *end, *p, *comma;
+	int k, top = -1, ndigits;
+	u32 chunk, top_chunk = 0;
+	char digits[8];
+
+	bitmap_zero(maskp, nmaskbits);
+
+	end = buf + strnlen(buf, buflen);
+	while (start < end && isspace(*start))
+		start++;
+	while (end > start && isspace(end[-1]))
+		end--;
+
+	/*
+	 * Walk the chunks from the least significant one, so that each can
+	 * be stored at its final position right away. Embedded whitespace
+	 * fails the hex digit check.
+	 */
+	for (k = 0; ; ++k) {
+		for (comma = end; comma > start && comma[-1] != ','; --comma)
+			;
+
+		p = comma;
+		ndigits = end - p;
+		while (ndigits > 8 && *p == '0') {
+			p++;
+			ndigits--;
+		}
+
+		if (ndigits == 0)
+			return -EINVAL;
+		if (ndigits > 8)
+			return -EOVERFLOW;
+
+		/*
+		 * Short chunks are zero extended whatever their position,
+		 * "1,0" is 0x100000000 as with __bitmap_parse_bytewise().
+		 * sysfs pads all but the most significant one.
+		 */
+		if (ndigits < 8) {
+			memset(digits, '0', sizeof(digits));
+			memcpy(digits + sizeof(digits) - ndigits, p, ndigits);
+			p = digits;
+		}
+
+		if (hex8_to_bin(p, &chunk))
+			return -EINVAL;
+
+		if (chunk) {
+			top = k;
+			top_chunk = chunk;
+			if (k * CHUNKSZ < nmaskbits)
+				maskp[k * CHUNKSZ / BITS_PER_LONG] |= (unsigned long)chunk
+					<< (k * CHUNKSZ % BITS_PER_LONG);
+		}
+
+		if (comma == start)
+			break;
+		end = comma - 1;
+	}
+
+	/* Leading zero chunks don't count */
+	if (top >= 0 && top * CHUNKSZ +
+			nbits_to_hold_value(top_chunk) > nmaskbits)
+		return -EOVERFLOW;
+
+	return 0;
+}
+EXPORT_SYMBOL(__bitmap_parse);
+
+/*
+ * __bitmap_parse_bytewise - __bitmap_parse() one character at a time,
+ * shifting the whole bitmap for every chunk. Quadratic in the mask width,
+ * kept as a reference for bench_parse.
+ */
+int __bitmap_parse_bytewise(const char *buf, unsigned int buflen,
+		unsigned long *maskp,
+		int nmaskbits)
 {
 	int c, old_c, totaldigits, ndigits, nchunks, nbits;
 	u32 chunk;
@@ -506,7 +896,7 @@ int __bitmap_parse(const char *buf, unsigned int buflen,
 
 	return 0;
 }
-EXPORT_SYMBOL(__bitmap_parse);
+EXPORT_SYMBOL(__bitmap_parse_bytewise);
 
 /**
  * bitmap_parse_user - convert an ASCII hex string in a user buffer into a bitmap
@@ -595,6 +985,25 @@ int bitmap_scnlistprintf(char *buf, unsigned int buflen,
 }
 EXPORT_SYMBOL(bitmap_scnlistprintf);
 
+/*
+ * Parse the decimal number at p into val, saturating at limit. Returns
+ * the end of the number or NULL if there are no digits at p.
+ */
+static const char *parse_decimal(const char *p, const char *end,
+		unsigned int *val, unsigned int limit)
+{
+	const char *start = p;
+	unsigned long v = 0;
+
+	for (; p < end && (unsigned char)(*p - '0') < 10; ++p) {
+		if (v < limit)
+			v = v * 10 + (*p - '0');
+	}
+
+	*val = v < limit ? v : limit;
+	return p > start ? p : NULL;
+}
+
 /**
  * __bitmap_parselist - convert list format ASCII string to bitmap
  * @buf: read nul-terminated user string from this buffer
@@ -612,11 +1021,57 @@ EXPORT_SYMBOL(bitmap_scnlistprintf);
  * Error values:
  *    %-EINVAL: second number in range smaller than first
  *    %-EINVAL: invalid character in string
+ *    %-EINVAL: empty cpu# or range, e.g., "1,,2"
  *    %-ERANGE: bit number specified too large for mask
  */
 static int __bitmap_parselist(const char *buf, unsigned int buflen,
 		unsigned long *maskp,
 		int nmaskbits)
+{
+	const char *p = buf, *end;
+	unsigned int a, b;
+
+	bitmap_zero(maskp, nmaskbits);
+
+	end = buf + strnlen(buf, buflen);
+	while (p < end && isspace(*p))
+		p++;
+	while (end > p && isspace(end[-1]))
+		end--;
+
+	while (p < end) {
+		p = parse_decimal(p, end, &a, nmaskbits);
+		if (!p)
+			return -EINVAL;
+
+		b = a;
+		if (p < end && *p == '-') {
+			p = parse_decimal(p + 1, end, &b, nmaskbits);
+			if (!p)
+				return -EINVAL;
+		}
+
+		if (!(a <= b))
+			return -EINVAL;
+		if (b >= (unsigned)nmaskbits)
+			return -ERANGE;
+
+		/* Whole words at a time */
+		bitmap_set(maskp, a, b - a + 1);
+
+		if (p < end && *p++ != ',')
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * __bitmap_parselist_bitwise - __bitmap_parselist() setting ranges one
+ * bit at a time, kept as a reference for bench_parse.
+ */
+int __bitmap_parselist_bitwise(const char *buf, unsigned int buflen,
+		unsigned long *maskp,
+		int nmaskbits)
 {
 	unsigned a, b;
 	int c, old_c, totaldigits;
@@ -678,6 +1133,7 @@ static int __bitmap_parselist(const char *buf, unsigned int buflen,
 	} while (buflen && c == ',');
 	return 0;
 }
+EXPORT_SYMBOL(__bitmap_parselist_bitwise);
 
 int bitmap_parselist(const char *bp, unsigned long *maskp, int nmaskbits)
 {
@@ -827,20 +1283,32 @@ void bitmap_remap(unsigned long *dst, const unsigned long *src,
 		const unsigned long *old, const unsigned long *new,
 		int bits)
 {
-	int oldbit, w;
+	int oldbit, newbit;
 
 	if (dst == src)		/* following doesn't handle inplace remaps */
 		return;
-	bitmap_zero(dst, bits);
 
-	w = bitmap_weight(new, bits);
-	for_each_set_bit(oldbit, src, bits) {
-	     	int n = bitmap_pos_to_ord(old, oldbit, bits);
+	newbit = find_first_bit(new, bits);
+	if (newbit >= bits) {
+		bitmap_copy(dst, src, bits);	/* identity map */
+		return;
+	}
 
-		if (n < 0 || w == 0)
-			set_bit(oldbit, dst);	/* identity map */
-		else
-			set_bit(bitmap_ord_to_pos(new, n % w, bits), dst);
+	/* Unset bits of old map to themselves */
+	bitmap_andnot(dst, src, old, bits);
+
+	/*
+	 * Walk old and new side by side, the n-th set bit of old meets the
+	 * (n % w)-th one of new, instead of looking up both ordinals per
+	 * bit of src, which is quadratic in the number of bits.
+	 */
+	for_each_set_bit(oldbit, old, bits) {
+		if (test_bit(oldbit, src))
+			set_bit(newbit, dst);
+
+		newbit = find_next_bit(new, bits, newbit + 1);
+		if (newbit >= bits)
+			newbit = find_first_bit(new, bits);
 	}
 }
 EXPORT_SYMBOL(bitmap_remap);
@@ -1179,3 +1647,54 @@ int bitmap_allocate_region(unsigned long *bitmap, int pos, int order)
 }
 EXPORT_SYMBOL(bitmap_allocate_region);
 
+/**
+ * bitmap_find_free_block - find a contiguous aligned block of any size
+ *	@bitmap: array of unsigned longs corresponding to the bitmap
+ *	@bits: number of bits in the bitmap
+ *	@size: number of bits in the block
+ *	@align: alignment of the block within its window
+ *	@window: blocks don't cross multiples of @window, 0 for no limit
+ *
+ * Like bitmap_find_free_region(), but neither the size nor the
+ * alignment of the block need to be powers of two, e.g., blocks of 3
+ * bits in windows of 12.  Free (zero) runs are skipped with
+ * find_next_zero_bit() and find_next_bit(), so the search is linear in
+ * the number of words and allocated runs rather than bits.
+ *
+ * Return the bit offset in bitmap of the allocated block,
+ * or -errno on failure.
+ */
+int bitmap_find_free_block(unsigned long *bitmap, int bits, int size,
+		int align, int window)
+{
+	int pos = 0, base, start, next;
+
+	if (size <= 0 || align <= 0 || (window && size > window))
+		return -EINVAL;
+
+	for (;;) {
+		pos = find_next_zero_bit(bitmap, bits, pos);
+		if (pos >= bits)
+			break;
+
+		/* First aligned start at or after pos within its window */
+		base = window ? pos - pos % window : 0;
+		start = base + (pos - base + align - 1) / align * align;
+		if (window && start - base + size > window) {
+			pos = base + window;
+			continue;
+		}
+		if (start + size > bits)
+			break;
+
+		next = find_next_bit(bitmap, start + size, start);
+		if (next >= start + size) {
+			bitmap_set(bitmap, start, size);
+			return start;
+		}
+		pos = next + 1;
+	}
+	return -ENOMEM;
+}
+EXPORT_SYMBOL(bitmap_find_free_block);
+
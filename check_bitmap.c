@@ -0,0 +1,508 @@
+/*
+ * check_bitmap: check the optimized bitmap code against its references
+ * on pseudo random input (run by make check).
+ *
+ *   ops         every bitmap_ops variant the CPU supports and the fixed
+ *               width ones against the *_generic word loops
+ *   parse       __bitmap_parse() against __bitmap_parse_bytewise(), also
+ *               on malformed input, which both have to reject
+ *   parselist   bitmap_parselist() against __bitmap_parselist_bitwise()
+ *   free_block  bitmap_find_free_block() against a brute force search
+ *   remap       bitmap_remap() against bitmap_bitremap() of each bit
+ *   cpurange    the range set membership, merge and intersection against
+ *               the same on cpumasks, also with too little room
+ *
+ * Prints one line per check and exits with failure if any mismatched.
+ *
+ * Usage: check_bitmap [-i ITERATIONS]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bench.h>
+#include <bitmap.h>
+#include <cpurange.h>
+
+#define MAX_BITS 4096
+#define WORDS BITS_TO_LONGS(MAX_BITS)
+
+/* Report at most this many mismatches per check */
+#define MAX_REPORTS 5
+
+static unsigned long state = BENCH_SEED;
+static int failed;
+
+static int rnd(int n)
+{
+	return xorshift64(&state) % n;
+}
+
+/* Random bits at a random density, the ones beyond nbits cleared */
+static void fill_random(unsigned long *mask, int nbits)
+{
+	unsigned long w;
+	int k, shift = rnd(4);
+
+	memset(mask, 0, sizeof(unsigned long) * WORDS);
+	for (k = 0; k < (int)BITS_TO_LONGS(nbits); ++k) {
+		w = xorshift64(&state);
+		/* Sparse or dense */
+		if (shift & 1)
+			w &= xorshift64(&state) >> rnd(8);
+		if (shift & 2)
+			w |= xorshift64(&state);
+		mask[k] = w;
+	}
+
+	if (nbits % BITS_PER_LONG)
+		mask[BIT_WORD(nbits)] &= BITMAP_LAST_WORD_MASK(nbits);
+}
+
+static int mismatch(const char *check, int *nr, const char *fmt, int a, int b)
+{
+	if (++*nr <= MAX_REPORTS) {
+		fprintf(stderr, "%s: mismatch: ", check);
+		fprintf(stderr, fmt, a, b);
+		fprintf(stderr, "\n");
+	}
+
+	return 1;
+}
+
+static void report(const char *check, const char *what, int nr_bad,
+		int nr_checked)
+{
+	printf("%-10s %-14s %s (%d checked)\n", check, what,
+			nr_bad ? "FAILED" : "ok", nr_checked);
+	if (nr_bad)
+		failed = 1;
+}
+
+/*
+ * Apply all operations of ops and the generic ones to the same input.
+ * fixed_bits is the only width fixed width ops may be used with.
+ */
+static void check_ops(const struct bitmap_ops *ops, int fixed_bits,
+		int iterations)
+{
+	static unsigned long a[WORDS], b[WORDS], d1[WORDS], d2[WORDS];
+	const struct bitmap_ops *ref = &bitmap_generic_ops;
+	int nbits, i, nr_bad = 0;
+	const char *name = ops->name;
+	int r1, r2;
+
+	for (i = 0; i < iterations; ++i) {
+		nbits = fixed_bits ? fixed_bits : 1 + rnd(MAX_BITS);
+		fill_random(a, nbits);
+		/* Equal, subset or unrelated */
+		switch (rnd(3)) {
+			case 0:
+				bitmap_copy(b, a, MAX_BITS);
+				break;
+			case 1:
+				bitmap_copy(b, a, MAX_BITS);
+				fill_random(d1, nbits);
+				__bitmap_or_generic(b, b, d1, nbits);
+				break;
+			default:
+				fill_random(b, nbits);
+		}
+
+		r1 = ops->and(d1, a, b, nbits);
+		r2 = ref->and(d2, a, b, nbits);
+		if (r1 != r2 || !bitmap_equal(d1, d2, nbits))
+			mismatch(name, &nr_bad, "and at %d bits (%d)", nbits, r1);
+
+		ops->or(d1, a, b, nbits);
+		ref->or(d2, a, b, nbits);
+		if (!bitmap_equal(d1, d2, nbits))
+			mismatch(name, &nr_bad, "or at %d bits (%d)", nbits, 0);
+
+		r1 = ops->andnot(d1, a, b, nbits);
+		r2 = ref->andnot(d2, a, b, nbits);
+		if (r1 != r2 || !bitmap_equal(d1, d2, nbits))
+			mismatch(name, &nr_bad, "andnot at %d bits (%d)", nbits, r1);
+
+		if (ops->intersects(a, b, nbits) != ref->intersects(a, b, nbits))
+			mismatch(name, &nr_bad, "intersects at %d bits (%d)",
+					nbits, 0);
+
+		if (ops->subset(a, b, nbits) != ref->subset(a, b, nbits))
+			mismatch(name, &nr_bad, "subset at %d bits (%d)", nbits, 0);
+
+		if (ops->equal(a, b, nbits) != ref->equal(a, b, nbits))
+			mismatch(name, &nr_bad, "equal at %d bits (%d)", nbits, 0);
+
+		r1 = ops->weight(a, nbits);
+		r2 = ref->weight(a, nbits);
+		if (r1 != r2)
+			mismatch(name, &nr_bad, "weight %d, expected %d", r1, r2);
+	}
+
+	report("ops", name, nr_bad, iterations);
+}
+
+static void check_all_ops(int iterations)
+{
+	const struct bitmap_ops *ops;
+	int n, nbits;
+
+	check_ops(&bitmap_generic_ops, 0, iterations);
+
+	for (n = 0; (ops = arch_bitmap_ops_nth(n)); ++n)
+		check_ops(ops, 0, iterations);
+
+	for (nbits = BITS_PER_LONG; nbits <= MAX_BITS; nbits *= 2) {
+		ops = bitmap_fixed_ops_for(nbits);
+		if (ops)
+			check_ops(ops, nbits, iterations / 8 + 1);
+	}
+}
+
+/* Damage a printed mask in one of the ways sysfs input may be broken */
+static void mangle(char *buf, int len)
+{
+	int n = strlen(buf);
+	int pos = n ? rnd(n) : 0;
+
+	switch (rnd(6)) {
+		case 0:
+			/* Drop a character, shortening a chunk */
+			memmove(buf + pos, buf + pos + 1, n - pos);
+			break;
+		case 1:
+			buf[pos] = "g, \n0"[rnd(5)];
+			break;
+		case 2:
+			/* Leading zero chunks or digits */
+			if (n + 10 < len) {
+				memmove(buf + 9, buf, n + 1);
+				memcpy(buf, rnd(2) ? "00000000," : "000000000", 9);
+			}
+			break;
+		case 3:
+			/* Surrounding whitespace */
+			if (n + 3 < len) {
+				memmove(buf + 1, buf, n + 1);
+				buf[0] = ' ';
+				strcat(buf, "\n");
+			}
+			break;
+		case 4:
+			buf[0] = '\0';
+			break;
+		default:
+			/* Intact */
+			break;
+	}
+}
+
+static void check_parse(int iterations)
+{
+	static unsigned long mask[WORDS], m1[WORDS], m2[WORDS];
+	static char buf[MAX_BITS * 4];
+	int nbits, i, r1, r2;
+	int nr_bad = 0;
+
+	for (i = 0; i < iterations; ++i) {
+		nbits = 1 + rnd(MAX_BITS);
+		fill_random(mask, nbits);
+		bitmap_scnprintf(buf, sizeof(buf), mask, nbits);
+		if (i % 2)
+			mangle(buf, sizeof(buf));
+
+		/* Narrower masks check the overflow detection */
+		if (rnd(4) == 0)
+			nbits = 1 + rnd(nbits);
+
+		/*
+		 * Both must reject the same input, but not necessarily with
+		 * the same error, they walk the chunks in opposite order.
+		 */
+		r1 = __bitmap_parse(buf, strlen(buf) + 1, m1, nbits);
+		r2 = __bitmap_parse_bytewise(buf, strlen(buf) + 1, m2, nbits);
+		if (!r1 != !r2 || (!r1 && !bitmap_equal(m1, m2, nbits)))
+			mismatch("parse", &nr_bad, "returned %d, expected %d", r1, r2);
+	}
+
+	report("parse", "hex", nr_bad, iterations);
+}
+
+static void check_parselist(int iterations)
+{
+	static unsigned long mask[WORDS], m1[WORDS], m2[WORDS];
+	static char buf[MAX_BITS * 4];
+	int nbits, i, r1, r2;
+	int nr_bad = 0;
+
+	for (i = 0; i < iterations; ++i) {
+		nbits = 1 + rnd(MAX_BITS);
+		fill_random(mask, nbits);
+		/* The reference parser takes "" for CPU 0 */
+		if (bitmap_empty(mask, nbits))
+			set_bit(0, mask);
+		bitmap_scnlistprintf(buf, sizeof(buf), mask, nbits);
+
+		if (rnd(4) == 0)
+			nbits = 1 + rnd(nbits);
+
+		r1 = bitmap_parselist(buf, m1, nbits);
+		r2 = __bitmap_parselist_bitwise(buf, strlen(buf), m2, nbits);
+		if (r1 != r2 || (!r1 && !bitmap_equal(m1, m2, nbits)))
+			mismatch("parselist", &nr_bad, "returned %d, expected %d",
+					r1, r2);
+	}
+
+	report("parse", "list", nr_bad, iterations);
+}
+
+/* First position satisfying the constraints of bitmap_find_free_block() */
+static int find_free_block_ref(const unsigned long *map, int bits, int size,
+		int align, int window)
+{
+	int pos, base, i;
+
+	for (pos = 0; pos + size <= bits; ++pos) {
+		base = window ? pos - pos % window : 0;
+		if ((pos - base) % align)
+			continue;
+		if (window && pos - base + size > window)
+			continue;
+
+		for (i = pos; i < pos + size; ++i) {
+			if (test_bit(i, map))
+				break;
+		}
+		if (i == pos + size)
+			return pos;
+	}
+
+	return -ENOMEM;
+}
+
+static void check_free_block(int iterations)
+{
+	static const int windows[] = { 0, 6, 8, 12, 16 };
+	static unsigned long map[WORDS], orig[WORDS];
+	int bits, size, align, window;
+	int i, pos, ref;
+	int nr_bad = 0;
+
+	for (i = 0; i < iterations; ++i) {
+		bits = 1 + rnd(256);
+		fill_random(map, bits);
+		window = windows[rnd(5)];
+		size = 1 + rnd(window ? window : 13);
+		align = 1 + rnd(6);
+		bitmap_copy(orig, map, MAX_BITS);
+
+		ref = find_free_block_ref(map, bits, size, align, window);
+		pos = bitmap_find_free_block(map, bits, size, align, window);
+		if (pos != ref) {
+			mismatch("free_block", &nr_bad, "at %d, expected %d", pos, ref);
+			continue;
+		}
+
+		/* Taken, and nothing else */
+		if (pos >= 0) {
+			bitmap_clear(map, pos, size);
+			if (!bitmap_equal(map, orig, bits))
+				mismatch("free_block", &nr_bad,
+						"block at %d of %d not taken", pos, size);
+		}
+	}
+
+	report("free_block", "", nr_bad, iterations);
+}
+
+static void check_remap(int iterations)
+{
+	static unsigned long src[WORDS], old[WORDS], new[WORDS];
+	static unsigned long dst[WORDS], ref[WORDS];
+	int bits, bit, i;
+	int nr_bad = 0;
+
+	for (i = 0; i < iterations; ++i) {
+		bits = 1 + rnd(512);
+		fill_random(src, bits);
+		fill_random(old, bits);
+		fill_random(new, bits);
+		/* Empty maps are the identity */
+		if (rnd(8) == 0)
+			bitmap_zero(old, bits);
+		if (rnd(8) == 0)
+			bitmap_zero(new, bits);
+
+		bitmap_remap(dst, src, old, new, bits);
+
+		bitmap_zero(ref, bits);
+		for_each_set_bit(bit, src, bits)
+			set_bit(bitmap_bitremap(bit, old, new, bits), ref);
+
+		if (!bitmap_equal(dst, ref, bits))
+			mismatch("remap", &nr_bad, "at %d bits (%d)", bits, 0);
+	}
+
+	report("remap", "", nr_bad, iterations);
+}
+
+/* The ranges of src as a set with exactly the room for them */
+static struct cpurange *range_copy(const struct cpumask *src)
+{
+	struct cpurange *set = cpurange_alloc(cpurange_nr_ranges(src));
+
+	if (!set || cpurange_from_cpumask(set, src) < 0) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return set;
+}
+
+/*
+ * The result of op has to hold exactly the CPUs of ref, in the fewest
+ * ranges, and op has to fail with -ENOSPC given one range less room.
+ */
+static void check_range_op(const char *what, int *nr_bad,
+		int (*op)(struct cpurange *, const struct cpurange *,
+			const struct cpurange *),
+		const struct cpurange *src1, const struct cpurange *src2,
+		const struct cpumask *ref, struct cpumask *tmp)
+{
+	int nr_ranges = cpurange_nr_ranges(ref);
+	struct cpurange *dst;
+	int ret;
+
+	dst = cpurange_alloc(nr_ranges);
+	if (!dst) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = op(dst, src1, src2);
+	cpurange_to_cpumask(tmp, dst);
+	if (ret < 0 || !cpumask_equal(tmp, ref) || dst->nr_ranges != nr_ranges)
+		mismatch("cpurange", nr_bad, what, dst->nr_ranges, nr_ranges);
+
+	if (nr_ranges) {
+		cpurange_init(dst, nr_ranges - 1);
+		ret = op(dst, src1, src2);
+		if (ret != -ENOSPC)
+			mismatch("cpurange", nr_bad, "returned %d, expected %d",
+					ret, -ENOSPC);
+	}
+
+	cpurange_free(dst);
+}
+
+static void check_cpurange_ops(int iterations)
+{
+	static const struct cpu_range fixed[][2] = {
+		/* Touching, overlapping, contained, apart */
+		{ { 0, 3 }, { 4, 7 } },
+		{ { 0, 5 }, { 3, 9 } },
+		{ { 2, 9 }, { 4, 5 } },
+		{ { 0, 0 }, { 2, 2 } },
+	};
+	const int nr_fixed = sizeof(fixed) / sizeof(fixed[0]);
+	struct cpumask *a, *b, *ref, *tmp;
+	struct cpurange *ra, *rb;
+	int nbits, cpu, i, k;
+	int nr_bad = 0;
+
+	/* Masks as wide as the largest input, no sysfs involved */
+	nr_cpu_ids = MAX_BITS;
+	nr_cpumask_bits = MAX_BITS;
+
+	a = cpumask_alloc();
+	b = cpumask_alloc();
+	ref = cpumask_alloc();
+	tmp = cpumask_alloc();
+	if (!a || !b || !ref || !tmp) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < iterations; ++i) {
+		if (i < nr_fixed) {
+			cpumask_clear(a);
+			cpumask_clear(b);
+			bitmap_set(a->bits, fixed[i][0].first,
+					fixed[i][0].last - fixed[i][0].first + 1);
+			bitmap_set(b->bits, fixed[i][1].first,
+					fixed[i][1].last - fixed[i][1].first + 1);
+		} else {
+			/* Short ones touch and overlap more often */
+			nbits = 1 + rnd(rnd(2) ? 64 : MAX_BITS);
+			fill_random(a->bits, nbits);
+			fill_random(b->bits, nbits);
+			/* Empty sets on either side */
+			if (rnd(8) == 0)
+				cpumask_clear(a);
+			if (rnd(8) == 0)
+				cpumask_clear(b);
+		}
+
+		ra = range_copy(a);
+		rb = range_copy(b);
+
+		for (k = 0; k < 8; ++k) {
+			cpu = rnd(MAX_BITS);
+			if (cpurange_test_cpu(cpu, ra) != cpumask_test_cpu(cpu, a))
+				mismatch("cpurange", &nr_bad, "test_cpu %d (%d)", cpu,
+						cpumask_test_cpu(cpu, a));
+		}
+
+		/* Either order has to come out the same */
+		cpumask_or(ref, a, b);
+		check_range_op("or in %d ranges, expected %d", &nr_bad,
+				cpurange_or, ra, rb, ref, tmp);
+		check_range_op("or in %d ranges, expected %d", &nr_bad,
+				cpurange_or, rb, ra, ref, tmp);
+
+		cpumask_and(ref, a, b);
+		check_range_op("and in %d ranges, expected %d", &nr_bad,
+				cpurange_and, ra, rb, ref, tmp);
+		check_range_op("and in %d ranges, expected %d", &nr_bad,
+				cpurange_and, rb, ra, ref, tmp);
+
+		cpurange_free(rb);
+		cpurange_free(ra);
+	}
+
+	cpumask_free(tmp);
+	cpumask_free(ref);
+	cpumask_free(b);
+	cpumask_free(a);
+
+	report("cpurange", "", nr_bad, iterations);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 20000;
+	const struct bench_option options[] = {
+		{ 'i', "ITERATIONS", &iterations },
+		{ 0, NULL, NULL },
+	};
+
+	bench_options(argc, argv, options, NULL);
+
+	if (iterations <= 0) {
+		fprintf(stderr, "error: invalid number of iterations\n");
+		exit(EXIT_FAILURE);
+	}
+
+	check_all_ops(iterations);
+	check_parse(iterations);
+	check_parselist(iterations);
+	check_free_block(iterations);
+	check_remap(iterations);
+	check_cpurange_ops(iterations);
+
+	return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# check_logical: --logical CPU numbers have to mean the same CPUs on the
+# rendezvous and on the --no-rendezvous path, and logically excluded CPUs
+# must not show up in the (logical) -v report (run by make check).
+#
+# Usage: check_logical.sh [MPIPIN]
+
+MPIPIN=${1:-./mpipin}
+PPN=2
+
+# Excluding logical CPU 0 needs CPUs left for both ranks
+EXCLUDE=
+if [ "$(nproc)" -ge $((PPN + 1)) ]; then
+	EXCLUDE="-e 0"
+fi
+
+# The report without the host, one line per rank in rank order
+report()
+{
+	sed -e 's/ @ [^ ]* / /' | sort
+}
+
+rendezvous=$( (
+	for i in $(seq $PPN); do
+		$MPIPIN --logical $EXCLUDE -v -p $PPN true &
+	done
+	wait
+) | report)
+
+no_rendezvous=$(
+	for i in $(seq 0 $((PPN - 1))); do
+		OMPI_COMM_WORLD_LOCAL_RANK=$i OMPI_COMM_WORLD_LOCAL_SIZE=$PPN \
+			$MPIPIN --no-rendezvous --logical $EXCLUDE -v -p $PPN true
+	done | report)
+
+failed=0
+if [ -z "$rendezvous" ] || [ "$rendezvous" != "$no_rendezvous" ]; then
+	echo "logical: mismatch: rendezvous:" >&2
+	echo "$rendezvous" >&2
+	echo "logical: mismatch: no rendezvous:" >&2
+	echo "$no_rendezvous" >&2
+	failed=1
+fi
+
+if [ -n "$EXCLUDE" ] && echo "$rendezvous" | grep -Eq 'CPU\(s\): 0([-, ]|$)'; then
+	echo "logical: mismatch: excluded CPU 0 assigned" >&2
+	failed=1
+fi
+
+printf "%-10s %-14s %s\n" logical "${EXCLUDE:-no exclude}" \
+	"$([ $failed = 0 ] && echo ok || echo FAILED)"
+exit $failed
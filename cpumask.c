@@ -0,0 +1,135 @@
+/*
+ * Runtime sized CPU masks, see include/cpumask.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <cpumask.h>
+
+int nr_cpu_ids = 0;
+int nr_cpumask_bits = 0;
+const struct bitmap_ops *cpumask_ops = &bitmap_ops;
+
+/*
+ * The unrolled fixed width loops beat the dispatched ones up to this
+ * width, the vector variants take over beyond (see bench_bitmap).
+ */
+#define CPUMASK_FIXED_MAX_BITS	256
+
+/*
+ * Size masks for the highest CPU number the kernel may bring online,
+ * i.e., the kernel's nr_cpu_ids.
+ */
+int cpumask_setup(void)
+{
+	const struct bitmap_ops *ops;
+	char buf[4096];
+	char *p, *end;
+	long cpu, max = -1;
+	int fd, len, width;
+
+	fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+	if (fd >= 0) {
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+
+		if (len > 0) {
+			buf[len] = '\0';
+			/* A list of ranges, e.g., 0-127,256-383 */
+			for (p = buf; *p; p = end) {
+				if (*p < '0' || *p > '9') {
+					end = p + 1;
+					continue;
+				}
+
+				cpu = strtol(p, &end, 10);
+				if (cpu > max)
+					max = cpu;
+			}
+		}
+	}
+
+	if (max < 0)
+		max = sysconf(_SC_NPROCESSORS_CONF) - 1;
+
+	if (max < 0)
+		return -EINVAL;
+
+	nr_cpu_ids = max + 1;
+
+	/*
+	 * The width only depends on nr_cpu_ids, masks in the shared segment
+	 * must have the same size whichever ops a process runs with.
+	 */
+	width = bitmap_fixed_width(nr_cpu_ids);
+	nr_cpumask_bits = width;
+
+	cpumask_ops = &bitmap_ops;
+	ops = bitmap_fixed_ops_for(width);
+	if (ops && (width <= CPUMASK_FIXED_MAX_BITS ||
+				!strcmp(bitmap_ops.name, bitmap_generic_ops.name)))
+		cpumask_ops = ops;
+
+	return 0;
+}
+
+struct cpumask *cpumask_alloc(void)
+{
+	return calloc(1, cpumask_size());
+}
+
+void cpumask_free(struct cpumask *mask)
+{
+	free(mask);
+}
+
+/*
+ * CPUs beyond nr_cpu_ids can never come online and are ignored, lists
+ * written for larger nodes (up to CPU_SETSIZE) are accepted as before.
+ */
+int cpumask_parselist(const char *buf, struct cpumask *dstp)
+{
+	int nbits = nr_cpu_ids > CPU_SETSIZE ? nr_cpu_ids : CPU_SETSIZE;
+	unsigned long *bits;
+	int ret;
+
+	bits = calloc(BITS_TO_LONGS(nbits), sizeof(unsigned long));
+	if (!bits)
+		return -ENOMEM;
+
+	ret = bitmap_parselist(buf, bits, nbits);
+	if (!ret) {
+		cpumask_clear(dstp);
+		bitmap_copy(dstp->bits, bits, nr_cpu_ids);
+
+		/* Keep bits beyond nr_cpu_ids zero */
+		if (nr_cpu_ids % BITS_PER_LONG)
+			dstp->bits[BIT_WORD(nr_cpu_ids)] &=
+				BITMAP_LAST_WORD_MASK(nr_cpu_ids);
+	}
+
+	free(bits);
+	return ret;
+}
+
+int cpumask_scnlistprintf(char *buf, unsigned int len,
+		const struct cpumask *srcp)
+{
+	return bitmap_scnlistprintf(buf, len, srcp->bits, nr_cpu_ids);
+}
+
+int sched_setaffinity_mask(pid_t pid, const struct cpumask *mask)
+{
+	return sched_setaffinity(pid, cpumask_size(),
+			(const cpu_set_t *)mask->bits);
+}
+
+int sched_getaffinity_mask(pid_t pid, struct cpumask *mask)
+{
+	return sched_getaffinity(pid, cpumask_size(), (cpu_set_t *)mask->bits);
+}
@@ -0,0 +1,229 @@
+/*
+ * Range compressed CPU sets, see include/cpurange.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <cpurange.h>
+
+struct cpurange *cpurange_alloc(int max_ranges)
+{
+	struct cpurange *set;
+
+	set = malloc(cpurange_size(max_ranges));
+	if (set)
+		cpurange_init(set, max_ranges);
+
+	return set;
+}
+
+void cpurange_free(struct cpurange *set)
+{
+	free(set);
+}
+
+/*
+ * Find the range of set bits starting at or after cpu, returns the first
+ * CPU of it or >= nr_cpu_ids if there is none.
+ */
+static int next_range(const struct cpumask *mask, int cpu, int *last)
+{
+	cpu = find_next_bit(mask->bits, nr_cpu_ids, cpu);
+	if (cpu < nr_cpu_ids)
+		*last = find_next_zero_bit(mask->bits, nr_cpu_ids, cpu + 1) - 1;
+
+	return cpu;
+}
+
+/* Number of ranges the CPUs of mask form */
+int cpurange_nr_ranges(const struct cpumask *mask)
+{
+	int cpu, last = -1, nr = 0;
+
+	for (cpu = next_range(mask, 0, &last); cpu < nr_cpu_ids;
+			cpu = next_range(mask, last + 1, &last))
+		++nr;
+
+	return nr;
+}
+
+/*
+ * Returns -ENOSPC if dst has no room for the ranges, see
+ * cpurange_nr_ranges().
+ */
+int cpurange_from_cpumask(struct cpurange *dst, const struct cpumask *src)
+{
+	int cpu, last = -1;
+
+	dst->nr_ranges = 0;
+	for (cpu = next_range(src, 0, &last); cpu < nr_cpu_ids;
+			cpu = next_range(src, last + 1, &last)) {
+		if (dst->nr_ranges == dst->max_ranges)
+			return -ENOSPC;
+
+		dst->ranges[dst->nr_ranges].first = cpu;
+		dst->ranges[dst->nr_ranges].last = last;
+		dst->nr_ranges++;
+	}
+
+	return 0;
+}
+
+void cpurange_to_cpumask(struct cpumask *dst, const struct cpurange *src)
+{
+	int i, first, last;
+
+	cpumask_clear(dst);
+	for (i = 0; i < src->nr_ranges; ++i) {
+		first = src->ranges[i].first;
+		last = src->ranges[i].last;
+
+		/* Sets may come from shared memory */
+		if (first < 0 || last < first || last >= nr_cpu_ids)
+			continue;
+
+		bitmap_set(dst->bits, first, last - first + 1);
+	}
+}
+
+/* Binary search for the range that would hold cpu */
+int cpurange_test_cpu(int cpu, const struct cpurange *set)
+{
+	int lo = 0, hi = set->nr_ranges - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (cpu < set->ranges[mid].first)
+			hi = mid - 1;
+		else if (cpu > set->ranges[mid].last)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Append a range to dst, merging it with the last one if they touch */
+static int append_range(struct cpurange *dst, int first, int last)
+{
+	struct cpu_range *prev;
+
+	if (dst->nr_ranges) {
+		prev = &dst->ranges[dst->nr_ranges - 1];
+		if (first <= prev->last + 1) {
+			if (last > prev->last)
+				prev->last = last;
+			return 0;
+		}
+	}
+
+	if (dst->nr_ranges == dst->max_ranges)
+		return -ENOSPC;
+
+	dst->ranges[dst->nr_ranges].first = first;
+	dst->ranges[dst->nr_ranges].last = last;
+	dst->nr_ranges++;
+	return 0;
+}
+
+/*
+ * Merge the ranges of both sets in order of their first CPU. dst may not
+ * be one of the sources. Returns -ENOSPC if dst has no room for the
+ * result.
+ */
+int cpurange_or(struct cpurange *dst, const struct cpurange *src1,
+		const struct cpurange *src2)
+{
+	const struct cpu_range *r;
+	int i = 0, j = 0;
+	int ret;
+
+	dst->nr_ranges = 0;
+	while (i < src1->nr_ranges || j < src2->nr_ranges) {
+		if (j == src2->nr_ranges || (i < src1->nr_ranges &&
+				src1->ranges[i].first <= src2->ranges[j].first))
+			r = &src1->ranges[i++];
+		else
+			r = &src2->ranges[j++];
+
+		ret = append_range(dst, r->first, r->last);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Intersect the ranges of both sets, advancing past whichever range ends
+ * first. dst may not be one of the sources. Returns -ENOSPC if dst has
+ * no room for the result.
+ */
+int cpurange_and(struct cpurange *dst, const struct cpurange *src1,
+		const struct cpurange *src2)
+{
+	const struct cpu_range *a, *b;
+	int i = 0, j = 0;
+	int first, last;
+	int ret;
+
+	dst->nr_ranges = 0;
+	while (i < src1->nr_ranges && j < src2->nr_ranges) {
+		a = &src1->ranges[i];
+		b = &src2->ranges[j];
+
+		first = a->first > b->first ? a->first : b->first;
+		last = a->last < b->last ? a->last : b->last;
+		if (first <= last) {
+			ret = append_range(dst, first, last);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (a->last < b->last)
+			++i;
+		else
+			++j;
+	}
+
+	return 0;
+}
+
+/*
+ * Same format as bitmap_scnlistprintf(), but printed straight from the
+ * ranges. Output is truncated to len - 1 characters, the number of
+ * characters written is returned.
+ */
+int cpurange_scnlistprintf(char *buf, unsigned int len,
+		const struct cpurange *set)
+{
+	const struct cpu_range *r;
+	unsigned int written = 0;
+	int i, n;
+
+	if (len == 0)
+		return 0;
+	buf[0] = '\0';
+
+	for (i = 0; i < set->nr_ranges && written < len - 1; ++i) {
+		r = &set->ranges[i];
+
+		if (r->first == r->last)
+			n = snprintf(buf + written, len - written, "%s%d",
+					i ? "," : "", r->first);
+		else
+			n = snprintf(buf + written, len - written, "%s%d-%d",
+					i ? "," : "", r->first, r->last);
+
+		if (n < 0)
+			break;
+
+		written += n;
+		if (written > len - 1)
+			written = len - 1;
+	}
+
+	return written;
+}
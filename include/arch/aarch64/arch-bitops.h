@@ -19,6 +19,13 @@ static inline void clear_bit(int nr, volatile unsigned long *addr)
 	*p  &= ~mask;
 }
 
+/*
+ * Bit scans and population counts are compiler builtins, which map to
+ * clz, rbit + clz and the ASIMD cnt instruction, all of them baseline
+ * on aarch64.
+ */
+#define ARCH_HAS_POPCNT 1
+
 /**
  * fls - find last (most-significant) bit set
  * @x: the word to search
@@ -26,67 +33,20 @@ static inline void clear_bit(int nr, volatile unsigned long *addr)
  * This is defined the same way as ffs.
  * Note fls(0) = 0, fls(1) = 1, fls(0x80000000) = 32.
  */
-
 static inline int fls(int x)
 {
-	int r = 32;
-
-	if (!x)
-		return 0;
-	if (!(x & 0xffff0000u)) {
-		x <<= 16;
-		r -= 16;
-	}
-	if (!(x & 0xff000000u)) {
-		x <<= 8;
-		r -= 8;
-	}
-	if (!(x & 0xf0000000u)) {
-		x <<= 4;
-		r -= 4;
-	}
-	if (!(x & 0xc0000000u)) {
-		x <<= 2;
-		r -= 2;
-	}
-	if (!(x & 0x80000000u)) {
-		x <<= 1;
-		r -= 1;
-	}
-	return r;
+	return x ? 32 - __builtin_clz(x) : 0;
 }
 
-
+/**
+ * __ffs - find first set bit in word
+ * @word: The word to search
+ *
+ * Undefined if no bit exists, so code should check against 0 first.
+ */
 static inline unsigned long __ffs(unsigned long word)
 {
-	int num = 0;
-
-	if (BITS_PER_LONG == 64) {
-		if ((word & 0xffffffff) == 0) {
-			num += 32;
-			word >>= 32;
-		}
-	}
-
-	if ((word & 0xffff) == 0) {
-		num += 16;
-		word >>= 16;
-	}
-	if ((word & 0xff) == 0) {
-		num += 8;
-		word >>= 8;
-	}
-	if ((word & 0xf) == 0) {
-		num += 4;
-		word >>= 4;
-	}
-	if ((word & 0x3) == 0) {
-		num += 2;
-		word >>= 2;
-	}
-	if ((word & 0x1) == 0)
-		num += 1;
-	return num;
+	return __builtin_ctzl(word);
 }
 
 #define ffz(x)	__ffs(~(x))
@@ -3,42 +3,33 @@
 
 //#define ARCH_HAS_FAST_MULTIPLIER 1
 
-static inline int fls(int x)
-{
-	int r;
-	asm("bsrl %1,%0\n\t"
-	    "jnz 1f\n\t"
-	    "movl $-1,%0\n"
-	    "1:" : "=r" (r) : "rm" (x));
-
-	return r + 1;
-}
-
 /*
- * glibc provides this.
+ * The bit scans are compiler builtins rather than inline asm so that
+ * they can be constant folded and scheduled. bsf/bsr are baseline
+ * x86_64, GCC emits tzcnt (rep bsf) where it is beneficial.
+ *
+ * POPCNT isn't baseline, hweight_long() only uses it if the compiler
+ * targets it (e.g., -march=native), bitmap weights detect it at runtime
+ * (see arch/x86_64/bitmap.c).
  */
-#if 0
+#ifdef __POPCNT__
+#define ARCH_HAS_POPCNT 1
+#endif
+
 /**
- * ffs - find first set bit in word
+ * fls - find last (most-significant) bit set
  * @x: the word to search
  *
- * This is defined the same way as the libc and compiler builtin ffs
- * routines, therefore differs in spirit from the other bitops.
- *
- * ffs(value) returns 0 if value is 0 or the position of the first
- * set bit if value is nonzero. The first (least significant) bit
- * is at position 1.
+ * fls(0) = 0, fls(1) = 1, fls(0x80000000) = 32.
  */
-static inline int ffs(int x)
+static inline int fls(int x)
 {
-	int r;
-	asm("bsfl %1,%0\n\t"
-	    "jnz 1f\n\t"
-	    "movl $-1,%0\n"
-	    "1:" : "=r" (r) : "rm" (x));
-	return r + 1;
+	return x ? 32 - __builtin_clz(x) : 0;
 }
-#endif
+
+/*
+ * glibc provides ffs.
+ */
 
 /**
  * __ffs - find first set bit in word
@@ -48,10 +39,7 @@ static inline int ffs(int x)
  */
 static inline unsigned long __ffs(unsigned long word)
 {
-	asm("bsf %1,%0"
-		: "=r" (word)
-		: "rm" (word));
-	return word;
+	return __builtin_ctzl(word);
 }
 
 /**
@@ -62,10 +50,7 @@ static inline unsigned long __ffs(unsigned long word)
  */
 static inline unsigned long ffz(unsigned long word)
 {
-	asm("bsf %1,%0"
-		: "=r" (word)
-		: "r" (~word));
-	return word;
+	return __builtin_ctzl(~word);
 }
 
 
@@ -0,0 +1,104 @@
+#ifndef INCLUDE_BENCH_H
+#define INCLUDE_BENCH_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Helpers shared by the bench_* programs: timing, a cheap PRNG, option
+ * parsing and the CSV output all of them produce.
+ */
+
+static inline unsigned long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Same sequence on every run for a given seed */
+static inline unsigned long xorshift64(unsigned long *state)
+{
+	unsigned long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+#define BENCH_SEED 0x9e3779b97f4a7c15UL
+
+/* Results are stored here so that timed code isn't optimized away */
+static volatile unsigned long bench_sink __attribute__((unused));
+
+/* An integer option, e.g., { 'r', "RUNS", &runs } for -r RUNS */
+struct bench_option {
+	int opt;
+	const char *arg;
+	int *value;
+};
+
+/*
+ * Parse the options of a table terminated by an entry with opt 0, exits
+ * with the usage on -h or an unknown option. args names the positional
+ * arguments in the usage (NULL if none), they start at optind.
+ */
+static inline void bench_options(int argc, char **argv,
+		const struct bench_option *options, const char *args)
+{
+	char optstring[64];
+	int len = 0;
+	int opt, i;
+
+	for (i = 0; options[i].opt && len < (int)sizeof(optstring) - 4; ++i) {
+		optstring[len++] = options[i].opt;
+		optstring[len++] = ':';
+	}
+	optstring[len++] = 'h';
+	optstring[len] = '\0';
+
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		for (i = 0; options[i].opt; ++i) {
+			if (options[i].opt == opt)
+				break;
+		}
+
+		if (opt != 'h' && options[i].opt) {
+			*options[i].value = atoi(optarg);
+			continue;
+		}
+
+		fprintf(stderr, "Usage: %s", argv[0]);
+		for (i = 0; options[i].opt; ++i) {
+			fprintf(stderr, " [-%c %s]", options[i].opt,
+					options[i].arg);
+		}
+		fprintf(stderr, "%s%s\n", args ? " " : "", args ? args : "");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* CSV header, the first column names the benchmark of each row */
+static inline void bench_csv_header(const char *columns)
+{
+	printf("benchmark,%s\n", columns);
+}
+
+/* One CSV row, flushed so that a partial run still leaves results */
+static inline void __attribute__((format(printf, 1, 2)))
+bench_csv_row(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+#endif /* INCLUDE_BENCH_H */
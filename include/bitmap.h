@@ -57,6 +57,8 @@
  * bitmap_find_free_region(bitmap, bits, order)	Find and allocate bit region
  * bitmap_release_region(bitmap, pos, order)	Free specified bit region
  * bitmap_allocate_region(bitmap, pos, order)	Allocate specified bit region
+ * bitmap_find_free_block(bitmap, bits, size, align, window)
+ *						Find and allocate any sized block
  */
 
 /*
@@ -113,6 +115,61 @@ extern int __bitmap_subset(const unsigned long *bitmap1,
 			const unsigned long *bitmap2, int bits);
 extern int __bitmap_weight(const unsigned long *bitmap, int bits);
 
+/*
+ * The word loops of the operations above are dispatched through
+ * bitmap_ops, which is set up at startup with the fastest variant the
+ * CPU supports. The MPIPIN_BITMAP_OPS environment variable selects one
+ * by name (e.g., scalar, popcnt, avx2, avx512, avx512_vpopcnt, neon or
+ * sve) instead.
+ * The scalar (generic) variants are the reference implementation.
+ */
+struct bitmap_ops {
+	const char *name;
+	int (*and)(unsigned long *dst, const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	void (*or)(unsigned long *dst, const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	int (*andnot)(unsigned long *dst, const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	int (*intersects)(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	int (*subset)(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	int (*equal)(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+	int (*weight)(const unsigned long *bitmap, int bits);
+};
+
+extern struct bitmap_ops bitmap_ops;
+extern const struct bitmap_ops bitmap_generic_ops;
+extern int bitmap_select_ops(const char *name);
+
+/* Provided by arch/<arch>/bitmap.c, NULL if nothing matches */
+extern const struct bitmap_ops *arch_bitmap_ops(const char *name);
+extern const struct bitmap_ops *arch_bitmap_ops_nth(int n);
+
+/*
+ * Unrolled variants for fixed widths of 64 to 4096 bits, for bitmaps
+ * whose bits beyond the width are always zero.
+ */
+extern int bitmap_fixed_width(int nbits);
+extern const struct bitmap_ops *bitmap_fixed_ops_for(int nbits);
+
+extern int __bitmap_and_generic(unsigned long *dst, const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern void __bitmap_or_generic(unsigned long *dst, const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern int __bitmap_andnot_generic(unsigned long *dst,
+			const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern int __bitmap_intersects_generic(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern int __bitmap_subset_generic(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern int __bitmap_equal_generic(const unsigned long *bitmap1,
+			const unsigned long *bitmap2, int bits);
+extern int __bitmap_weight_generic(const unsigned long *bitmap, int bits);
+
 extern void bitmap_set(unsigned long *map, int i, int len);
 extern void bitmap_clear(unsigned long *map, int start, int nr);
 extern unsigned long bitmap_find_next_zero_area(unsigned long *map,
@@ -127,12 +184,16 @@ extern int __bitmap_parse(const char *buf, unsigned int buflen,
 			unsigned long *dst, int nbits);
 extern int bitmap_parse_user(const char __user *ubuf, unsigned int ulen,
 			unsigned long *dst, int nbits);
+extern int __bitmap_parse_bytewise(const char *buf, unsigned int buflen,
+			unsigned long *dst, int nbits);
 extern int bitmap_scnlistprintf(char *buf, unsigned int len,
 			const unsigned long *src, int nbits);
 extern int bitmap_parselist(const char *buf, unsigned long *maskp,
 			int nmaskbits);
 extern int bitmap_parselist_user(const char __user *ubuf, unsigned int ulen,
 			unsigned long *dst, int nbits);
+extern int __bitmap_parselist_bitwise(const char *buf, unsigned int buflen,
+			unsigned long *maskp, int nmaskbits);
 extern void bitmap_remap(unsigned long *dst, const unsigned long *src,
 		const unsigned long *old, const unsigned long *new, int bits);
 extern int bitmap_bitremap(int oldbit,
@@ -144,6 +205,8 @@ extern void bitmap_fold(unsigned long *dst, const unsigned long *orig,
 extern int bitmap_find_free_region(unsigned long *bitmap, int bits, int order);
 extern void bitmap_release_region(unsigned long *bitmap, int pos, int order);
 extern int bitmap_allocate_region(unsigned long *bitmap, int pos, int order);
+extern int bitmap_find_free_block(unsigned long *bitmap, int bits, int size,
+		int align, int window);
 extern int bitmap_ord_to_pos(const unsigned long *bitmap, int n, int bits);
 
 #define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
@@ -37,10 +37,9 @@ extern unsigned int __sw_hweight16(unsigned int w);
 extern unsigned int __sw_hweight8(unsigned int w);
 extern unsigned long __sw_hweight64(uint64_t w);
 
-static inline unsigned long hweight_long(unsigned long w)
-{
-	return sizeof(w) == 4 ? __sw_hweight32(w) : __sw_hweight64(w);
-}
+/* Portable references of the arch bit scans */
+extern int __sw_fls(int x);
+extern unsigned long __sw_ffs(unsigned long word);
 
 #define BIT(nr)			(1UL << (nr))
 #define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
@@ -55,5 +54,18 @@ static inline unsigned long hweight_long(unsigned long w)
 
 #include <arch-bitops.h>
 
+#ifndef __ASSEMBLY__
+
+static inline unsigned long hweight_long(unsigned long w)
+{
+#ifdef ARCH_HAS_POPCNT
+	return __builtin_popcountl(w);
+#else
+	return sizeof(w) == 4 ? __sw_hweight32(w) : __sw_hweight64(w);
+#endif
+}
+
+#endif /*__ASSEMBLY__*/
+
 #endif /*INCLUDE_BITOPS_H*/
 
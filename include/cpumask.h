@@ -0,0 +1,212 @@
+#ifndef INCLUDE_CPUMASK_H
+#define INCLUDE_CPUMASK_H
+
+#include <stddef.h>
+#include <sched.h>
+#include <bitmap.h>
+
+/*
+ * CPU masks sized at runtime for the CPUs the kernel may ever bring
+ * online (nr_cpu_ids), unlike cpu_set_t which is fixed to CPU_SETSIZE bits.
+ * cpumask_setup() has to be called before any other operation.
+ */
+struct cpumask {
+	unsigned long bits[0];
+};
+
+#define cpumask_bits(maskp)	((maskp)->bits)
+
+extern int nr_cpu_ids;
+
+/*
+ * Width masks are stored and operated on with, nr_cpu_ids rounded up to
+ * the next width there are unrolled ops for, whether cpumask_ops are the
+ * unrolled ones or not. Bits beyond nr_cpu_ids are kept zero.
+ */
+extern int nr_cpumask_bits;
+extern const struct bitmap_ops *cpumask_ops;
+
+int cpumask_setup(void);
+struct cpumask *cpumask_alloc(void);
+void cpumask_free(struct cpumask *mask);
+int cpumask_parselist(const char *buf, struct cpumask *dstp);
+int cpumask_scnlistprintf(char *buf, unsigned int len,
+		const struct cpumask *srcp);
+int sched_setaffinity_mask(pid_t pid, const struct cpumask *mask);
+int sched_getaffinity_mask(pid_t pid, struct cpumask *mask);
+
+/* Bytes of a mask, a multiple of the word size as the kernel requires */
+static inline size_t cpumask_size(void)
+{
+	return BITS_TO_LONGS(nr_cpumask_bits) * sizeof(unsigned long);
+}
+
+static inline void cpumask_set_cpu(unsigned int cpu, struct cpumask *dstp)
+{
+	if (cpu < (unsigned int)nr_cpu_ids)
+		dstp->bits[BIT_WORD(cpu)] |= BIT(cpu % BITS_PER_LONG);
+}
+
+static inline void cpumask_clear_cpu(unsigned int cpu, struct cpumask *dstp)
+{
+	if (cpu < (unsigned int)nr_cpu_ids)
+		dstp->bits[BIT_WORD(cpu)] &= ~BIT(cpu % BITS_PER_LONG);
+}
+
+static inline int cpumask_test_cpu(unsigned int cpu, const struct cpumask *srcp)
+{
+	if (cpu >= (unsigned int)nr_cpu_ids)
+		return 0;
+
+	return (srcp->bits[BIT_WORD(cpu)] >> (cpu % BITS_PER_LONG)) & 1;
+}
+
+static inline void cpumask_clear(struct cpumask *dstp)
+{
+	bitmap_zero(dstp->bits, nr_cpumask_bits);
+}
+
+static inline void cpumask_copy(struct cpumask *dstp,
+		const struct cpumask *srcp)
+{
+	bitmap_copy(dstp->bits, srcp->bits, nr_cpumask_bits);
+}
+
+static inline int cpumask_and(struct cpumask *dstp,
+		const struct cpumask *src1p, const struct cpumask *src2p)
+{
+	return cpumask_ops->and(dstp->bits, src1p->bits, src2p->bits,
+			nr_cpumask_bits);
+}
+
+static inline void cpumask_or(struct cpumask *dstp,
+		const struct cpumask *src1p, const struct cpumask *src2p)
+{
+	cpumask_ops->or(dstp->bits, src1p->bits, src2p->bits, nr_cpumask_bits);
+}
+
+static inline void cpumask_xor(struct cpumask *dstp,
+		const struct cpumask *src1p, const struct cpumask *src2p)
+{
+	bitmap_xor(dstp->bits, src1p->bits, src2p->bits, nr_cpu_ids);
+}
+
+static inline int cpumask_andnot(struct cpumask *dstp,
+		const struct cpumask *src1p, const struct cpumask *src2p)
+{
+	return cpumask_ops->andnot(dstp->bits, src1p->bits, src2p->bits,
+			nr_cpumask_bits);
+}
+
+static inline int cpumask_equal(const struct cpumask *src1p,
+		const struct cpumask *src2p)
+{
+	return cpumask_ops->equal(src1p->bits, src2p->bits, nr_cpumask_bits);
+}
+
+static inline int cpumask_empty(const struct cpumask *srcp)
+{
+	return bitmap_empty(srcp->bits, nr_cpu_ids);
+}
+
+static inline int cpumask_weight(const struct cpumask *srcp)
+{
+	return cpumask_ops->weight(srcp->bits, nr_cpumask_bits);
+}
+
+/**
+ * cpumask_first - get the first cpu in a cpumask
+ * @srcp: the cpumask pointer
+ *
+ * Returns >= nr_cpu_ids if no cpus set.
+ */
+static inline unsigned int cpumask_first(const struct cpumask *srcp)
+{
+	return find_first_bit(srcp->bits, nr_cpu_ids);
+}
+
+/**
+ * cpumask_next - get the next cpu in a cpumask
+ * @n: the cpu prior to the place to search (ie. return will be > @n)
+ * @srcp: the cpumask pointer
+ *
+ * Returns >= nr_cpu_ids if no further cpus set.
+ */
+static inline unsigned int cpumask_next(int n, const struct cpumask *srcp)
+{
+	return find_next_bit(srcp->bits, nr_cpu_ids, n + 1);
+}
+
+/*
+ * Iterator state of for_each_cpu(): the bits of the current word not yet
+ * visited and the CPU number of its bit 0. Set bits are taken off the
+ * word one by one with __ffs(), empty words are skipped as a whole.
+ * flip is ~0UL to iterate over the clear bits instead.
+ */
+struct cpumask_iter {
+	const unsigned long *bits;
+	unsigned long word;
+	unsigned long flip;
+	int base;
+};
+
+static inline struct cpumask_iter cpumask_iter_start(
+		const struct cpumask *srcp, unsigned long flip)
+{
+	struct cpumask_iter iter = {
+		.bits = srcp->bits,
+		.word = srcp->bits[0] ^ flip,
+		.flip = flip,
+		.base = 0,
+	};
+
+	return iter;
+}
+
+/* Returns >= nr_cpu_ids if no further cpus set */
+static inline int cpumask_iter_next(struct cpumask_iter *iter)
+{
+	int cpu;
+
+	while (!iter->word) {
+		iter->base += BITS_PER_LONG;
+		if (iter->base >= nr_cpu_ids)
+			return nr_cpu_ids;
+
+		iter->word = iter->bits[BIT_WORD(iter->base)] ^ iter->flip;
+	}
+
+	cpu = iter->base + __ffs(iter->word);
+	iter->word &= iter->word - 1;
+
+	/* Bits of the last word past nr_cpu_ids */
+	return cpu < nr_cpu_ids ? cpu : nr_cpu_ids;
+}
+
+/**
+ * for_each_cpu - iterate over every cpu in a mask
+ * @cpu: the (optionally unsigned) integer iterator
+ * @mask: the cpumask pointer
+ *
+ * After the loop, cpu is >= nr_cpu_ids. Clearing or setting bits of the
+ * mask in the loop body affects the iteration only for words not yet
+ * reached.
+ */
+#define for_each_cpu(cpu, mask)						\
+	for (struct cpumask_iter __iter = cpumask_iter_start((mask), 0UL);	\
+		(cpu) = cpumask_iter_next(&__iter),			\
+		(cpu) < nr_cpu_ids;)
+
+/**
+ * for_each_cpu_not - iterate over every cpu in a complemented mask
+ * @cpu: the (optionally unsigned) integer iterator
+ * @mask: the cpumask pointer
+ *
+ * After the loop, cpu is >= nr_cpu_ids.
+ */
+#define for_each_cpu_not(cpu, mask)					\
+	for (struct cpumask_iter __iter = cpumask_iter_start((mask), ~0UL);	\
+		(cpu) = cpumask_iter_next(&__iter),			\
+		(cpu) < nr_cpu_ids;)
+
+#endif /* INCLUDE_CPUMASK_H */
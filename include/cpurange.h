@@ -0,0 +1,66 @@
+#ifndef INCLUDE_CPURANGE_H
+#define INCLUDE_CPURANGE_H
+
+#include <stddef.h>
+#include <cpumask.h>
+
+/* CPUs first to last, inclusive */
+struct cpu_range {
+	int first;
+	int last;
+};
+
+/*
+ * A set of CPUs as sorted, disjoint and non-adjacent ranges. Rank CPU
+ * sets usually consist of one or two ranges, which makes them much
+ * smaller than a cpumask on large nodes. The ranges are stored inline,
+ * so that sets can be placed in shared memory; max_ranges is the room
+ * there is for them.
+ */
+struct cpurange {
+	int nr_ranges;
+	int max_ranges;
+	struct cpu_range ranges[0];
+};
+
+/* Bytes of a set with room for max_ranges ranges */
+static inline size_t cpurange_size(int max_ranges)
+{
+	return sizeof(struct cpurange) + sizeof(struct cpu_range) * max_ranges;
+}
+
+static inline void cpurange_init(struct cpurange *set, int max_ranges)
+{
+	set->nr_ranges = 0;
+	set->max_ranges = max_ranges;
+}
+
+static inline int cpurange_empty(const struct cpurange *set)
+{
+	return set->nr_ranges == 0;
+}
+
+static inline int cpurange_weight(const struct cpurange *set)
+{
+	int i, weight = 0;
+
+	for (i = 0; i < set->nr_ranges; ++i)
+		weight += set->ranges[i].last - set->ranges[i].first + 1;
+
+	return weight;
+}
+
+struct cpurange *cpurange_alloc(int max_ranges);
+void cpurange_free(struct cpurange *set);
+int cpurange_nr_ranges(const struct cpumask *mask);
+int cpurange_from_cpumask(struct cpurange *dst, const struct cpumask *src);
+void cpurange_to_cpumask(struct cpumask *dst, const struct cpurange *src);
+int cpurange_test_cpu(int cpu, const struct cpurange *set);
+int cpurange_or(struct cpurange *dst, const struct cpurange *src1,
+		const struct cpurange *src2);
+int cpurange_and(struct cpurange *dst, const struct cpurange *src1,
+		const struct cpurange *src2);
+int cpurange_scnlistprintf(char *buf, unsigned int len,
+		const struct cpurange *set);
+
+#endif /* INCLUDE_CPURANGE_H */
@@ -0,0 +1,105 @@
+#ifndef INCLUDE_FUTEX_H
+#define INCLUDE_FUTEX_H
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Futexes on words in shared memory, i.e., non-private operations.
+ */
+
+static inline int futex_wait(int *uaddr, int val,
+		const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline int futex_wake(int *uaddr, int nr)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAKE, nr, NULL, NULL, 0);
+}
+
+static inline int futex_wake_all(int *uaddr)
+{
+	return futex_wake(uaddr, INT_MAX);
+}
+
+static inline long timespec_diff_ns(const struct timespec *a,
+		const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000L +
+		(a->tv_nsec - b->tv_nsec);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	asm volatile("pause" ::: "memory");
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+/*
+ * futex_wait_change - wait for a word to change from its old value
+ * @uaddr: the futex word
+ * @old: the value observed before going to sleep
+ * @spin_ns: spin this long before going to sleep, 0 to sleep right away
+ * @timeout_ms: timeout in milliseconds measured on CLOCK_MONOTONIC
+ *
+ * Spinning avoids the sleep/wakeup round trip when the word changes
+ * shortly after we got here, it only pays off if the waker isn't
+ * competing with us for a CPU though.
+ *
+ * Returns 0 once *uaddr != old or -ETIMEDOUT.
+ */
+static inline int futex_wait_change(int *uaddr, int old, long spin_ns,
+		long timeout_ms)
+{
+	struct timespec start, deadline, now, rel;
+	long left;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (spin_ns > 0) {
+		for (i = 0; i < 128; ++i) {
+			if (__atomic_load_n(uaddr, __ATOMIC_ACQUIRE) != old)
+				return 0;
+			cpu_relax();
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_ns(&now, &start) >= spin_ns)
+			break;
+	}
+
+	deadline = start;
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		++deadline.tv_sec;
+	}
+
+	while (__atomic_load_n(uaddr, __ATOMIC_ACQUIRE) == old) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timespec_diff_ns(&deadline, &now);
+		if (left <= 0)
+			return -ETIMEDOUT;
+
+		rel.tv_sec = left / 1000000000L;
+		rel.tv_nsec = left % 1000000000L;
+		/* Relative FUTEX_WAIT timeouts are on CLOCK_MONOTONIC */
+		futex_wait(uaddr, old, &rel);
+	}
+
+	return 0;
+}
+
+#endif /* INCLUDE_FUTEX_H */
@@ -41,9 +41,13 @@
 #include <getopt.h>
 #include <numa.h>
 #include <numaif.h>
+#include <limits.h>
 
 #include <bitmap.h>
+#include <cpumask.h>
+#include <cpurange.h>
 #include <list.h>
+#include <futex.h>
 
 //#define DEBUG
 
@@ -54,46 +58,25 @@
 #endif
 
 
-/**
- * cpuset_first - get the first cpu in a cpuset
- * @srcp: the cpuset pointer
- *
- * Returns >= nr_cpu_ids if no cpus set.
- */
-static inline unsigned int cpuset_first(const cpu_set_t *srcp)
-{
-	return find_first_bit((const long unsigned int*)
-			srcp, sizeof(cpu_set_t) * BITS_PER_BYTE);
-}
-
-/**
- * cpuset_next - get the next cpu in a cpuset
- * @n: the cpu prior to the place to search (ie. return will be > @n)
- * @srcp: the cpuset pointer
- *
- * Returns >= nr_cpu_ids if no further cpus set.
- */
-static inline unsigned int cpuset_next(int n, const cpu_set_t *srcp)
-{
-	return find_next_bit((const long unsigned int*)srcp,
-			sizeof(cpu_set_t) * BITS_PER_BYTE, n+1);
-}
-
-/**
- * for_each_cpu - iterate over every cpu in a set
- * @cpu: the (optionally unsigned) integer iterator
- * @set: the cpuset pointer
- *
- * After the loop, cpu is >= nr_cpu_ids.
- */
-#define for_each_cpu(cpu, set)				\
-	for ((cpu) = -1;				\
-		(cpu) = cpuset_next((cpu), (set)),	\
-		(cpu) < get_nprocs_conf();)
-
+#define HELPER_NONE		0
+#define HELPER_PER_RANK		1
+#define HELPER_PER_NODE		2
 
 int compact = 1;
 int verbose = 0;
+/* CLOCK_MONOTONIC timestamp of mpipin's startup in ns */
+unsigned long start_ts;
+char *thread_policy = NULL;
+int no_rendezvous = 0;
+int share_node = 0;
+int reuse_shm = 0;
+char *rank_order = "pid";
+long rank_key = 0;
+char *trace_dir = NULL;
+int helper_mode = HELPER_NONE;
+int helper_cpus = 0;
+int block_placement = 0;
+int logical_cpus = 0;
 struct option options[] = {
 	{
 		.name =		"compact",
@@ -107,6 +90,12 @@ struct option options[] = {
 		.flag =		&compact,
 		.val =		0,
 	},
+	{
+		.name =		"blocks",
+		.has_arg =	no_argument,
+		.flag =		&block_placement,
+		.val =		1,
+	},
 	{
 		.name =		"tpp",
 		.has_arg =	required_argument,
@@ -149,6 +138,12 @@ struct option options[] = {
 		.flag =		NULL,
 		.val =		'e',
 	},
+	{
+		.name =		"logical",
+		.has_arg =	no_argument,
+		.flag =		&logical_cpus,
+		.val =		1,
+	},
 	{
 		.name =		"help",
 		.has_arg =	no_argument,
@@ -161,6 +156,54 @@ struct option options[] = {
 		.flag =		NULL,
 		.val =		'v',
 	},
+	{
+		.name =		"pin-threads",
+		.has_arg =	optional_argument,
+		.flag =		NULL,
+		.val =		'T',
+	},
+	{
+		.name =		"helper-cpus",
+		.has_arg =	required_argument,
+		.flag =		NULL,
+		.val =		'H',
+	},
+	{
+		.name =		"no-rendezvous",
+		.has_arg =	no_argument,
+		.flag =		&no_rendezvous,
+		.val =		1,
+	},
+	{
+		.name =		"share-node",
+		.has_arg =	no_argument,
+		.flag =		&share_node,
+		.val =		1,
+	},
+	{
+		.name =		"reuse-shm",
+		.has_arg =	no_argument,
+		.flag =		&reuse_shm,
+		.val =		1,
+	},
+	{
+		.name =		"rank-order",
+		.has_arg =	required_argument,
+		.flag =		NULL,
+		.val =		'O',
+	},
+	{
+		.name =		"rank-key",
+		.has_arg =	required_argument,
+		.flag =		NULL,
+		.val =		'K',
+	},
+	{
+		.name =		"trace",
+		.has_arg =	required_argument,
+		.flag =		NULL,
+		.val =		'D',
+	},
 	/* end */
 	{ NULL, 0, NULL, 0, },
 };
@@ -174,11 +217,41 @@ void print_usage(char **argv)
 	printf("Mandatory arguments to long options are mandatory for short options too.\n");
 	printf("    --compact                   Lay out processes in a compact fashion.\n");
 	printf("    --scatter                   Lay out processes in a scattered fashion.\n");
+	printf("    --blocks                    Assign each process an aligned block of CPUs\n");
+	printf("                                within or spanning cache domains.\n");
 	printf("    -n, -p, --processes-per-node, --ranks-per-node,\n");
 	printf("    --ppn=PPN                   Number of processes per node.\n");
 	printf("    -t, --threads-per-processes, --cores-per-processes, \n");
-	printf("    --tpp=TPP                   Assign TPP logical CPUs per process.\n");
+	printf("    --tpp=TPP                   Assign TPP logical CPUs per process, either a\n");
+	printf("                                single number, a list for consecutive processes\n");
+	printf("                                (2,12,12) or process classes (0:2,1-3:8,*:12).\n");
 	printf("    -e, --exclude-cpus=CPULIST  Exclude CPULIST logical CPUs from assignment.\n");
+	printf("    --logical                   CPU numbers of --exclude-cpus and -v are logical:\n");
+	printf("                                topological order, threads of a core adjacent.\n");
+	printf("                                MPIPIN_CPUS and MPIPIN_HELPER_CPUS exported to\n");
+	printf("                                the program stay OS numbers.\n");
+	printf("    --pin-threads[=POLICY]      Pin each thread of a process to one of its CPUs\n");
+	printf("                                (preloads libmpipin_threads.so), POLICY for\n");
+	printf("                                threads beyond TPP: share (default), float, helper.\n");
+	printf("    --helper-cpus=per-rank:N|per-node:N\n");
+	printf("                                Reserve N CPUs for progress/helper threads next\n");
+	printf("                                to each process or once for the whole node.\n");
+	printf("    --no-rendezvous             Don't wait for the other processes, use the\n");
+	printf("                                node-local rank provided by the launcher\n");
+	printf("                                (Open MPI, MPICH/Hydra, PMIx or Slurm).\n");
+	printf("    --share-node                Place processes around the CPUs used by other\n");
+	printf("                                jobs of the same user started with --share-node\n");
+	printf("                                on this node. Requires the rendezvous. Jobs\n");
+	printf("                                of other users aren't taken into account.\n");
+	printf("    --reuse-shm                 Keep the shared memory of the launcher for\n");
+	printf("                                subsequent job steps, which may overlap.\n");
+	printf("    --rank-order=ORDER          Order of node-local ranks, ORDER is pid (default),\n");
+	printf("                                start (mpipin start time), env (local rank\n");
+	printf("                                provided by the launcher) or env:VAR.\n");
+	printf("    --rank-key=N                Explicit ordering key of this process, implies\n");
+	printf("                                --rank-order=key, other orders are rejected.\n");
+	printf("    --trace=DIR                 Append startup phase timestamps of each process\n");
+	printf("                                to DIR/mpipin.<hostname>.csv.\n");
 	printf("\n");
 	printf("Example: \n");
 	printf("    mpirun -hostfile hosts -n N -ppn P mpipin -p P -t $OMP_NUM_THREADS --exclude-cpus 0-4 app arg1\n");
@@ -200,7 +273,7 @@ struct cache_topology {
 	long number_of_sets;
 	long physical_line_partition;
 	long ways_of_associativity;
-	cpu_set_t shared_cpu_map;
+	struct cpumask *shared_cpu_map;
 };
 
 struct cpu_topology {
@@ -210,8 +283,8 @@ struct cpu_topology {
 	int hw_id;
 	long physical_package_id;
 	long core_id;
-	cpu_set_t core_siblings;
-	cpu_set_t thread_siblings;
+	struct cpumask *core_siblings;
+	struct cpumask *thread_siblings;
 	struct list_head cache_topology_list;
 };
 
@@ -219,7 +292,7 @@ struct node_topology {
 	struct list_head list;
 	int node_number;
 	int padding;
-	cpu_set_t cpumap;
+	struct cpumask *cpumap;
 };
 
 LIST_HEAD(cpu_topology_list);
@@ -227,6 +300,99 @@ LIST_HEAD(node_topology_list);
 
 #define PAGE_SIZE	(4096)
 
+static unsigned long get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Startup phases, each timestamp is taken when the phase completes.
+ * Phases a process doesn't go through are left 0.
+ */
+enum trace_phase {
+	TRACE_ENTRY,
+	TRACE_FLOCK,
+	TRACE_SHM_ATTACH,
+	TRACE_ARRIVAL,
+	TRACE_RANKED,
+	TRACE_WAKEUP,
+	TRACE_TOPOLOGY,
+	TRACE_PLAN,
+	TRACE_SETAFFINITY,
+	TRACE_EXEC,
+	TRACE_NR_PHASES,
+};
+
+static const char *trace_phase_names[TRACE_NR_PHASES] = {
+	"entry", "flock", "shm_attach", "arrival", "ranked", "wakeup",
+	"topology", "plan", "setaffinity", "exec",
+};
+
+unsigned long trace_ts[TRACE_NR_PHASES];
+
+static inline void trace_point(enum trace_phase phase)
+{
+	trace_ts[phase] = get_time_ns();
+}
+
+/*
+ * Append this process' timestamps (CLOCK_MONOTONIC ns, comparable across
+ * the processes of the node) to the trace file of the node.
+ */
+static int write_trace(const char *dir, int rank)
+{
+	char path[PATH_MAX];
+	char host[256];
+	char line[1024];
+	struct stat st;
+	int fd, len, i;
+	int ret = -EIO;
+
+	gethostname(host, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+	snprintf(path, sizeof(path), "%s/mpipin.%s.csv", dir, host);
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: error: opening %s\n", __FUNCTION__, path);
+		return -errno;
+	}
+
+	/* Lines of concurrent processes mustn't interleave */
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+		goto out;
+
+	if (st.st_size == 0) {
+		len = snprintf(line, sizeof(line), "job,pid,rank");
+		for (i = 0; i < TRACE_NR_PHASES; ++i) {
+			len += snprintf(line + len, sizeof(line) - len, ",%s",
+					trace_phase_names[i]);
+		}
+		len += snprintf(line + len, sizeof(line) - len, "\n");
+		if (write(fd, line, len) != len)
+			goto unlock_out;
+	}
+
+	len = snprintf(line, sizeof(line), "%d,%d,%d", getppid(), getpid(), rank);
+	for (i = 0; i < TRACE_NR_PHASES; ++i) {
+		len += snprintf(line + len, sizeof(line) - len, ",%lu", trace_ts[i]);
+	}
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+	if (write(fd, line, len) == len)
+		ret = 0;
+
+unlock_out:
+	flock(fd, LOCK_UN);
+out:
+	if (ret < 0)
+		fprintf(stderr, "%s: error: writing %s\n", __FUNCTION__, path);
+	close(fd);
+	return ret;
+}
+
 static int read_file(void *buf, size_t size, char *fmt, va_list ap)
 {
 	int n, ss;
@@ -503,6 +669,13 @@ static int collect_cache_topology(struct cpu_topology *cpu_topo, int index)
 
 	p->index = index;
 
+	p->shared_cpu_map = cpumask_alloc();
+	if (!p->shared_cpu_map) {
+		error = -ENOMEM;
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		goto out;
+	}
+
 	error = read_long(&p->level, "%s/level", prefix);
 	if (error) {
 		fprintf(stderr, "%s: error: accessing sysfs\n", __FUNCTION__);
@@ -557,7 +730,7 @@ static int collect_cache_topology(struct cpu_topology *cpu_topo, int index)
 		goto out;
 	}
 
-	error = read_bitmap(&p->shared_cpu_map, get_nprocs_conf(),
+	error = read_bitmap(cpumask_bits(p->shared_cpu_map), nr_cpu_ids,
 			"%s/shared_cpu_map", prefix);
 	if (error) {
 		fprintf(stderr, "%s: error: accessing sysfs\n", __FUNCTION__);
@@ -572,6 +745,7 @@ out:
 	if (p) {
 		free(p->type);
 		free(p->size_str);
+		cpumask_free(p->shared_cpu_map);
 		free(p);
 	}
 
@@ -615,6 +789,14 @@ static int collect_cpu_topology(int cpu)
 	INIT_LIST_HEAD(&p->cache_topology_list);
 	p->cpu_id = cpu;
 
+	p->core_siblings = cpumask_alloc();
+	p->thread_siblings = cpumask_alloc();
+	if (!p->core_siblings || !p->thread_siblings) {
+		error = -ENOMEM;
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		goto out;
+	}
+
 	error = read_long(&p->core_id, "%s/topology/core_id", prefix);
 	if (error) {
 		error = -EINVAL;
@@ -622,7 +804,7 @@ static int collect_cpu_topology(int cpu)
 		goto out;
 	}
 
-	error = read_bitmap(&p->core_siblings, get_nprocs_conf(),
+	error = read_bitmap(cpumask_bits(p->core_siblings), nr_cpu_ids,
 			"%s/topology/core_siblings", prefix);
 	if (error) {
 		error = -EINVAL;
@@ -638,7 +820,7 @@ static int collect_cpu_topology(int cpu)
 		goto out;
 	}
 
-	error = read_bitmap(&p->thread_siblings, get_nprocs_conf(),
+	error = read_bitmap(cpumask_bits(p->thread_siblings), nr_cpu_ids,
 			"%s/topology/thread_siblings", prefix);
 	if (error) {
 		error = -EINVAL;
@@ -673,7 +855,11 @@ static int collect_cpu_topology(int cpu)
 	p = NULL;
 
 out:
-	free(p);
+	if (p) {
+		cpumask_free(p->core_siblings);
+		cpumask_free(p->thread_siblings);
+		free(p);
+	}
 	free(prefix);
 	return error;
 }
@@ -693,7 +879,14 @@ static int collect_node_topology(int node)
 
 	p->node_number = node;
 
-	error = read_bitmap(&p->cpumap, get_nprocs_conf(),
+	p->cpumap = cpumask_alloc();
+	if (!p->cpumap) {
+		error = -ENOMEM;
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		goto out;
+	}
+
+	error = read_bitmap(cpumask_bits(p->cpumap), nr_cpu_ids,
 			"/sys/devices/system/node/node%d/cpumap", node);
 	if (error) {
 		error = -ENOMEM;
@@ -706,42 +899,58 @@ static int collect_node_topology(int node)
 	p = NULL;
 
 out:
-	free(p);
+	if (p) {
+		cpumask_free(p->cpumap);
+		free(p);
+	}
 	return error;
 }
 
 static int collect_topology(void)
 {
 	int cpu, node;
-	cpu_set_t cpus;
+	struct cpumask *cpus;
+	int error = -EINVAL;
+
+	/* Collected once per process */
+	if (!list_empty(&cpu_topology_list)) {
+		return 0;
+	}
 
 	if (numa_available() == -1) {
 		return -EINVAL;
 	}
 
-	if (read_bitmap_parselist(&cpus, get_nprocs_conf(),
+	cpus = cpumask_alloc();
+	if (!cpus) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	if (read_bitmap_parselist(cpumask_bits(cpus), nr_cpu_ids,
 				"/sys/devices/system/cpu/online",
 				0) < 0) {
-		return -EINVAL;
+		goto out;
 	}
 
-	for (cpu = 0; cpu < get_nprocs_conf(); ++cpu) {
-		if (CPU_ISSET(cpu, &cpus)) {
-			if (collect_cpu_topology(cpu) < 0) {
-				fprintf(stderr, "error: collecting CPU topology\n");
-				return -EINVAL;
-			}
+	for_each_cpu(cpu, cpus) {
+		if (collect_cpu_topology(cpu) < 0) {
+			fprintf(stderr, "error: collecting CPU topology\n");
+			goto out;
 		}
 	}
 
 	for (node = 0; node < numa_num_configured_nodes(); ++node) {
 		if (collect_node_topology(node) < 0) {
 			fprintf(stderr, "error: collecting NUMA node topology\n");
-			return -EINVAL;
+			goto out;
 		}
 	}
 
-	return 0;
+	error = 0;
+out:
+	cpumask_free(cpus);
+	return error;
 }
 
 /*
@@ -749,375 +958,2641 @@ static int collect_topology(void)
  */
 struct process_list_item {
 	int ready;
-	int timeout;
 	int pid;
-	unsigned long start_ts;
-
-	pthread_condattr_t wait_cv_attr;
-	pthread_cond_t wait_cv;
-	int next_process_ind;
+	int rank;
+	/* Ranks are assigned in increasing order of key, then PID */
+	long key;
+	/* See process_start_time(), 0 if unknown */
+	unsigned long start_time;
 };
 
-#define MAX_PROCESSES 1024
+#define MAX_PROCESSES 16384
+
+#define MPIPIN_MAGIC	(0xEEEEABCD)
+#define MPIPIN_SHM_VERSION	8
+
+/*
+ * Ranks of a job are usually launched within a fraction of a millisecond,
+ * spin this long for the plan before sleeping unless CPUs are oversubscribed.
+ */
+#define RENDEZVOUS_SPIN_NS 200000L
+
+/*
+ * How often waiting ranks check whether the others are still alive,
+ * stretched up to RENDEZVOUS_CHECK_MAX_MS on oversubscribed nodes so that
+ * waiters don't slow down the arrival of the others.
+ */
+#define RENDEZVOUS_CHECK_MS 100L
+#define RENDEZVOUS_CHECK_MAX_MS 1000L
+
+/*
+ * Where the CPUs planned for a rank are in the range pool, helpers
+ * shared by all ranks are stored only once.
+ */
+struct rank_plan {
+	size_t affinity_off;
+	size_t helpers_off;
+};
 
+/*
+ * A header followed by the per-process arrays, which are sized for the
+ * number of processes of the job, the pool the planned CPU sets are
+ * allocated from as range lists and the node wide CPU masks, which are
+ * sized for nr_cpu_ids. Offsets are relative to the header.
+ */
 struct part_exec {
+	unsigned int magic;
+	unsigned int version;
+	size_t size;
+	int max_processes;
+	int nr_cpu_ids;
+	size_t mask_size;
+	size_t tpp_off;
+	size_t processes_off;
+	size_t plans_off;
+	size_t ranges_off;
+	size_t ranges_size;
+	size_t allowed_off;
+	size_t cpus_available_off;
+	size_t plan_cpus_off;
+	size_t cpu_order_off;
 	pthread_mutexattr_t lock_attr;
 	pthread_mutex_t lock;
 	int nr_processes;
 	int nr_processes_left;
-	int nr_processes_left_in_init;
-	int process_rank;
-	cpu_set_t cpus_used;
-	cpu_set_t cpus_available;
-	int cpus_to_assign;
-	int first_process_ind;
-	struct process_list_item processes[MAX_PROCESSES];
-	cpu_set_t affinities[MAX_PROCESSES];
+	/*
+	 * Consecutive partitioned executions (job steps) may share the
+	 * segment. Arriving processes draw a ticket, ticket / nr_processes
+	 * is the epoch they belong to, ticket % nr_processes their slot.
+	 * An epoch starts once the previous one has left. Tickets are
+	 * drawn under the flock of the segment file.
+	 */
+	int next_ticket;
+	int epoch;
+	/* Bumped by every arrival, the planner sleeps on it */
+	int arrivals;
+	/* Bumped when the plan is published or startup is aborted */
+	int generation;
+	/* Sticky, an aborted segment isn't reused */
+	int aborted;
+	int helper_mode;
+	int helper_cpus;
+	int block_placement;
+	/* Plan of the previous epoch and the CPUs it was computed for */
+	int plan_cached;
+	/* Bytes of the range pool taken by the plan */
+	size_t ranges_used;
 };
 
-int pin_process(struct part_exec *pe, int ppn)
+/*
+ * Size of the partitioning information for nr_processes processes.
+ * Fills in the header if pe is given.
+ */
+static size_t part_exec_layout(struct part_exec *pe, int nr_processes)
 {
-	struct cpu_topology *cpu_top, *cpu_top_i;
-	struct cache_topology *cache_top;
-	int cpu, cpus_assigned, cpu_prev;
-	int ret = 0;
-	cpu_set_t *cpus_available = NULL;
-	cpu_set_t *cpus_to_use = NULL;
-	int my_i, i, prev_i, next_i;
-
-	pthread_mutex_lock(&pe->lock);
+	size_t tpp_off, processes_off, plans_off, ranges_off, ranges_size;
+	size_t allowed_off, cpus_available_off, plan_cpus_off, cpu_order_off;
+	size_t mask_size = cpumask_size();
+	size_t size;
 
-	/* First process to enter CPU partitioning */
-	if (pe->nr_processes == -1) {
-		pe->nr_processes = ppn;
-		pe->nr_processes_left = ppn;
-		dprintf("%s: nr_processes: %d (partitioned exec starts)\n",
-				__FUNCTION__,
-				pe->nr_processes);
+	/*
+	 * Two sets per rank. The CPUs planned for the ranks add up to at most
+	 * nr_cpu_ids + nr_processes (one each when oversubscribing), a set
+	 * has no more ranges than CPUs and the same is allowed for helpers.
+	 * Plans not fitting are rejected by pe_store_cpus().
+	 */
+	ranges_size = cpurange_size(0) * 2 * nr_processes +
+		(cpurange_size(1) - cpurange_size(0)) *
+		2 * (nr_cpu_ids + nr_processes);
+
+	tpp_off = ALIGN(sizeof(struct part_exec), 64);
+	processes_off = ALIGN(tpp_off + sizeof(int) * nr_processes, 64);
+	plans_off = ALIGN(processes_off +
+			sizeof(struct process_list_item) * nr_processes, 64);
+	ranges_off = ALIGN(plans_off + sizeof(struct rank_plan) * nr_processes,
+			64);
+	allowed_off = ALIGN(ranges_off + ranges_size, 64);
+	cpus_available_off = allowed_off + mask_size * nr_processes;
+	plan_cpus_off = cpus_available_off + mask_size;
+	cpu_order_off = plan_cpus_off + mask_size;
+	size = cpu_order_off + sizeof(int) * nr_cpu_ids;
+
+	if (pe) {
+		pe->magic = MPIPIN_MAGIC;
+		pe->version = MPIPIN_SHM_VERSION;
+		pe->size = size;
+		pe->max_processes = nr_processes;
+		pe->nr_cpu_ids = nr_cpu_ids;
+		pe->mask_size = mask_size;
+		pe->tpp_off = tpp_off;
+		pe->processes_off = processes_off;
+		pe->plans_off = plans_off;
+		pe->ranges_off = ranges_off;
+		pe->ranges_size = ranges_size;
+		pe->allowed_off = allowed_off;
+		pe->cpus_available_off = cpus_available_off;
+		pe->plan_cpus_off = plan_cpus_off;
+		pe->cpu_order_off = cpu_order_off;
 	}
 
-	if (pe->nr_processes != ppn) {
-		fprintf(stderr, "%s: error: requested number of processes"
-				" doesn't match current partitioned execution\n",
-				__FUNCTION__);
-		ret = -EINVAL;
-		goto unlock_out;
-	}
+	return size;
+}
+
+/*
+ * Validate a header written by another process.
+ */
+static int part_exec_valid(struct part_exec *pe, size_t size)
+{
+	return size >= sizeof(struct part_exec) &&
+		pe->magic == MPIPIN_MAGIC &&
+		pe->version == MPIPIN_SHM_VERSION &&
+		pe->nr_cpu_ids == nr_cpu_ids &&
+		pe->size <= size &&
+		part_exec_layout(NULL, pe->max_processes) == pe->size;
+}
 
-	--pe->nr_processes_left;
-	dprintf("%s: nr_processes: %d, nr_processes_left: %d\n",
-			__FUNCTION__,
-			pe->nr_processes,
-			pe->nr_processes_left);
+static inline int *pe_tpp(struct part_exec *pe)
+{
+	return (int *)((char *)pe + pe->tpp_off);
+}
 
-	/* Find empty process slot */
-	my_i = -1;
-	for (i = 0; i < MAX_PROCESSES; ++i) {
-		if (pe->processes[i].pid == 0) {
-			my_i = i;
-			break;
-		}
-	}
+static inline struct process_list_item *pe_processes(struct part_exec *pe)
+{
+	return (struct process_list_item *)((char *)pe + pe->processes_off);
+}
 
-	pe->processes[my_i].pid = getpid();
-	pe->processes[my_i].ready = 0;
-	pe->processes[my_i].timeout = 0;
-	pe->processes[my_i].next_process_ind = -1;
+static inline struct rank_plan *pe_plans(struct part_exec *pe)
+{
+	return (struct rank_plan *)((char *)pe + pe->plans_off);
+}
 
-	/*
-	 * Add ourself to the list in order of PID
-	 * TODO: add start time
-	 */
-	if (pe->first_process_ind == -1) {
-		pe->first_process_ind = my_i;
-		dprintf("%s: add to empty list as first\n",
+static inline const struct cpurange *pe_affinity(struct part_exec *pe,
+		int rank)
+{
+	return (struct cpurange *)((char *)pe + pe->ranges_off +
+			pe_plans(pe)[rank].affinity_off);
+}
+
+static inline const struct cpurange *pe_helper(struct part_exec *pe, int rank)
+{
+	return (struct cpurange *)((char *)pe + pe->ranges_off +
+			pe_plans(pe)[rank].helpers_off);
+}
+
+/*
+ * Store the CPUs of mask in the range pool, off is set to where.
+ * Called with pe->lock held.
+ */
+static int pe_store_cpus(struct part_exec *pe, const struct cpumask *mask,
+		size_t *off)
+{
+	int nr_ranges = cpurange_nr_ranges(mask);
+	size_t size = cpurange_size(nr_ranges);
+	struct cpurange *set;
+
+	if (pe->ranges_used + size > pe->ranges_size) {
+		fprintf(stderr, "%s: error: plan doesn't fit in shared memory\n",
 				__FUNCTION__);
+		return -ENOSPC;
 	}
-	else {
-		prev_i = -1;
-		for (i = pe->first_process_ind; i != -1;
-				i = pe->processes[i].next_process_ind) {
 
-			if (pe->processes[i].pid > getpid()) {
-				break;
-			}
+	set = (struct cpurange *)((char *)pe + pe->ranges_off +
+			pe->ranges_used);
+	cpurange_init(set, nr_ranges);
+	cpurange_from_cpumask(set, mask);
 
-			prev_i = i;
-		}
+	*off = pe->ranges_used;
+	pe->ranges_used += size;
+	return 0;
+}
 
-		/* First element */
-		if (prev_i == -1) {
-			pe->processes[my_i].next_process_ind = pe->first_process_ind;
-			pe->first_process_ind = my_i;
-			dprintf("%s: add to non-empty list as first\n",
-					__FUNCTION__);
-		}
-		/* After prev_i */
-		else {
-			pe->processes[my_i].next_process_ind =
-				pe->processes[prev_i].next_process_ind;
-			pe->processes[prev_i].next_process_ind = my_i;
-			dprintf("%s: add to non-empty list after PID %d\n",
-					__FUNCTION__, pe->processes[prev_i].pid);
-		}
-	}
+/* The planned CPUs of a rank as masks, helpers may be NULL */
+static void pe_rank_cpus(struct part_exec *pe, int rank,
+		struct cpumask *affinity, struct cpumask *helpers)
+{
+	cpurange_to_cpumask(affinity, pe_affinity(pe, rank));
+	if (helpers)
+		cpurange_to_cpumask(helpers, pe_helper(pe, rank));
+}
 
-	next_i = -1;
+/*
+ * CPUs a process (by slot) was allowed to run on when it arrived. Full
+ * masks, an arbitrary affinity has no better worst case as ranges.
+ */
+static inline struct cpumask *pe_allowed(struct part_exec *pe, int slot)
+{
+	return (struct cpumask *)((char *)pe + pe->allowed_off +
+			pe->mask_size * slot);
+}
 
-	/* Last process? Wake up first in list */
-	if (pe->nr_processes_left == 0) {
-		next_i = pe->first_process_ind;
-		pe->first_process_ind = pe->processes[next_i].next_process_ind;
+static inline struct cpumask *pe_cpus_available(struct part_exec *pe)
+{
+	return (struct cpumask *)((char *)pe + pe->cpus_available_off);
+}
 
-		pe->processes[next_i].ready = 1;
-		dprintf("%s: waking PID %d\n",
-				__FUNCTION__, pe->processes[next_i].pid);
-		pthread_cond_signal(&pe->processes[next_i].wait_cv);
+static inline struct cpumask *pe_plan_cpus(struct part_exec *pe)
+{
+	return (struct cpumask *)((char *)pe + pe->plan_cpus_off);
+}
 
-		/* Reset process counter */
-		pe->nr_processes_left = pe->nr_processes;
-		pe->process_rank = 0;
-	}
+/* Topological position of each CPU */
+static inline int *pe_cpu_order(struct part_exec *pe)
+{
+	return (int *)((char *)pe + pe->cpu_order_off);
+}
 
-	/* Wait for the rest if we aren't the next */
-	if (next_i != my_i) {
-		struct process_list_item *pli = &pe->processes[my_i];
-		struct timespec ts;
+static struct cpu_topology *get_cpu_topology(int cpu)
+{
+	struct cpu_topology *cpu_top;
 
-		dprintf("%s: pid: %d, waiting in list\n",
-				__FUNCTION__, getpid());
-		/* Timeout period: 10 secs + (#procs * 0.1sec) */
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += (10 + pe->nr_processes / 10);
-
-		ret = pthread_cond_timedwait(&pli->wait_cv,
-				&pe->lock, &ts);
-
-		/* First timeout task? Wake up everyone else,
-		 * but tell them we timed out */
-		if (ret == ETIMEDOUT) {
-abort_all:
-			fprintf(stderr, "%s: error: pid: %d, timed out, waking everyone\n",
-					__FUNCTION__, getpid());
-			while (pe->first_process_ind != -1) {
-				struct process_list_item *pli_next =
-					&pe->processes[pe->first_process_ind];
+	list_for_each_entry(cpu_top, &cpu_topology_list, list) {
+		if (cpu_top->cpu_id == cpu)
+			return cpu_top;
+	}
 
-				pe->first_process_ind =
-					pe->processes[pe->first_process_ind].next_process_ind;
-				if (pli_next->pid == getpid())
-					continue;
-				dprintf("%s: waking next proc: %d\n",
-						__FUNCTION__, pli_next->pid);
+	return NULL;
+}
 
-				pli_next->ready = 1;
-				pli_next->timeout = 1;
-				pthread_cond_signal(&pli_next->wait_cv);
-			}
+static int ulong_cmp(const void *a, const void *b)
+{
+	unsigned long ua = *(const unsigned long *)a;
+	unsigned long ub = *(const unsigned long *)b;
 
-			/* Reset process counter to start state */
-			pe->nr_processes = -1;
-			ret = -ETIMEDOUT;
+	return ua < ub ? -1 : ua > ub;
+}
 
-			fprintf(stderr, "%s: error: pid: %d, woken everyone, out\n",
-					__FUNCTION__, getpid());
-			goto unlock_out;
-		}
+/*
+ * Topological order of CPUs: package, NUMA node, L3 domain, L2 domain,
+ * core and finally the CPU number, so that CPUs sharing the closest
+ * cache are adjacent.
+ */
+#define CPU_ORDER_KEYS	6
 
-		/* Interrupted or woken up by someone else due to timeout? */
-		if (pli->timeout) {
-			fprintf(stderr, "%s: error: pid: %d, job startup timed out\n",
-					__FUNCTION__, getpid());
-			ret = -ETIMEDOUT;
-			goto unlock_out;
-		}
+struct cpu_order_key {
+	int cpu;
+	long key[CPU_ORDER_KEYS];
+};
 
-		/* Incorrect wakeup state? */
-		if (!pli->ready) {
-			fprintf(stderr, "%s: error: pid: %d, not ready but woken?\n",
-					__FUNCTION__, getpid());
-			ret = -EINVAL;
-			goto unlock_out;
-		}
+static long cache_domain_id(struct cpu_topology *cpu_top, int level)
+{
+	struct cache_topology *cache_top;
 
-		dprintf("%s: pid: %d, woken up\n",
-				__FUNCTION__, getpid());
+	list_for_each_entry(cache_top, &cpu_top->cache_topology_list, list) {
+		if (cache_top->level == level &&
+				strcmp(cache_top->type, "Instruction")) {
+			return cpumask_first(cache_top->shared_cpu_map);
+		}
 	}
 
-	--pe->nr_processes_left;
+	return -1;
+}
 
-	/* First process does the partitioning */
-	if (pe->process_rank == 0) {
-		/* Collect topology information */
-		if (collect_topology() < 0) {
-			fprintf(stderr, "%s: error: collecting topology information\n",
-					__FUNCTION__);
-			/* Ugly.. */
-			ret = ETIMEDOUT;
-			goto abort_all;
-		}
+static int cpu_order_key_cmp(const void *a, const void *b)
+{
+	const struct cpu_order_key *ka = a;
+	const struct cpu_order_key *kb = b;
+	int i;
 
-		dprintf("%s: topology information collected\n", __FUNCTION__);
+	for (i = 0; i < CPU_ORDER_KEYS; ++i) {
+		if (ka->key[i] != kb->key[i])
+			return ka->key[i] < kb->key[i] ? -1 : 1;
+	}
 
-		cpus_available = malloc(sizeof(*cpus_available));
-		cpus_to_use = malloc(sizeof(*cpus_to_use));
-		if (!cpus_available || !cpus_to_use) {
-			fprintf(stderr, "%s: error: allocating cpu masks\n", __FUNCTION__);
-			ret = -ENOMEM;
-			goto unlock_out;
-		}
+	return 0;
+}
 
-		for (pe->process_rank = 0;
-				pe->process_rank < pe->nr_processes;
-				++pe->process_rank) {
+/*
+ * Record the topological position of every CPU in cpu_order.
+ * CPUs without topology information are placed last.
+ */
+static int order_topology(int *cpu_order)
+{
+	struct cpu_topology *cpu_top;
+	struct cpu_order_key *keys;
+	int nr_cpus = 0;
+	int cpu, i;
 
-			memcpy(cpus_available, &pe->cpus_available, sizeof(cpu_set_t));
-			memset(cpus_to_use, 0, sizeof(cpu_set_t));
+	keys = malloc(sizeof(*keys) * nr_cpu_ids);
+	if (!keys) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
 
-			/* Find the first unused CPU */
-			cpu = cpuset_first(cpus_available);
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		cpu_order[cpu] = nr_cpu_ids + cpu;
+	}
 
-			CPU_CLR(cpu, cpus_available);
-			CPU_SET(cpu, cpus_to_use);
+	list_for_each_entry(cpu_top, &cpu_topology_list, list) {
+		struct cpu_order_key *k = &keys[nr_cpus++];
 
-			cpu_prev = cpu;
-			dprintf("%s: CPU %d assigned (first)\n", __FUNCTION__, cpu);
+		k->cpu = cpu_top->cpu_id;
+		k->key[0] = cpu_top->physical_package_id;
+		k->key[1] = cpu_top->node_id;
+		k->key[2] = cache_domain_id(cpu_top, 3);
+		k->key[3] = cache_domain_id(cpu_top, 2);
+		k->key[4] = cpumask_first(cpu_top->thread_siblings);
+		k->key[5] = cpu_top->cpu_id;
+	}
 
-			for (cpus_assigned = 1; cpus_assigned < pe->cpus_to_assign;
-					++cpus_assigned) {
-				int node;
+	qsort(keys, nr_cpus, sizeof(*keys), cpu_order_key_cmp);
 
-				cpu_top = NULL;
-				/* Find the topology object of the last core assigned */
-				list_for_each_entry(cpu_top_i, &cpu_topology_list, list) {
-					if (cpu_top_i->cpu_id == cpu_prev) {
-						cpu_top = cpu_top_i;
-						break;
+	for (i = 0; i < nr_cpus; ++i) {
+		cpu_order[keys[i].cpu] = i;
+	}
+
+	free(keys);
+	return 0;
+}
+
+/*
+ * Logical CPU numbering (--logical): the logical number of a CPU is its
+ * topological position, so that the same CPU list selects the same
+ * placement on nodes enumerating CPUs differently, e.g., SMT siblings
+ * at +N rather than adjacent.
+ *
+ * The order is split into as few chains as possible in which both OS
+ * and logical numbers increase (one per SMT thread with siblings at +N,
+ * a single one if they are adjacent). Each chain is an order preserving
+ * map between two masks, which bitmap_remap() applies to all CPUs of a
+ * mask at once.
+ */
+struct cpu_numbering {
+	int nr_chains;
+	struct cpumask **os;
+	struct cpumask **logical;
+};
+
+struct cpu_numbering cpu_numbering;
+
+static int add_cpu_chain(struct cpu_numbering *num)
+{
+	struct cpumask **os, **logical;
+
+	os = realloc(num->os, sizeof(*os) * (num->nr_chains + 1));
+	if (!os)
+		return -ENOMEM;
+	num->os = os;
+
+	logical = realloc(num->logical, sizeof(*logical) * (num->nr_chains + 1));
+	if (!logical)
+		return -ENOMEM;
+	num->logical = logical;
+
+	os[num->nr_chains] = cpumask_alloc();
+	logical[num->nr_chains] = cpumask_alloc();
+	if (!os[num->nr_chains] || !logical[num->nr_chains]) {
+		cpumask_free(os[num->nr_chains]);
+		cpumask_free(logical[num->nr_chains]);
+		return -ENOMEM;
+	}
+
+	++num->nr_chains;
+	return 0;
+}
+
+/*
+ * Split the topological order of cpu_order (see order_topology()) into
+ * chains. Does nothing if already done, the order of a node is fixed.
+ */
+static int setup_cpu_numbering(struct cpu_numbering *num, const int *cpu_order)
+{
+	int *cpus = NULL, *last = NULL;
+	int cpu, pos, chain;
+	int ret = -ENOMEM;
+
+	if (num->nr_chains)
+		return 0;
+
+	cpus = malloc(sizeof(*cpus) * nr_cpu_ids);
+	last = malloc(sizeof(*last) * nr_cpu_ids);
+	if (!cpus || !last) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		goto out;
+	}
+
+	for (pos = 0; pos < nr_cpu_ids; ++pos) {
+		cpus[pos] = -1;
+	}
+
+	/* CPUs without topology information have no logical number */
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		if (cpu_order[cpu] < nr_cpu_ids)
+			cpus[cpu_order[cpu]] = cpu;
+	}
+
+	for (pos = 0; pos < nr_cpu_ids; ++pos) {
+		if (cpus[pos] < 0)
+			continue;
+
+		/* First fit, the last CPUs of the chains are decreasing */
+		for (chain = 0; chain < num->nr_chains; ++chain) {
+			if (last[chain] < cpus[pos])
+				break;
+		}
+
+		if (chain == num->nr_chains && add_cpu_chain(num) < 0) {
+			fprintf(stderr, "%s: error: allocating memory\n",
+					__FUNCTION__);
+			goto out;
+		}
+
+		last[chain] = cpus[pos];
+		cpumask_set_cpu(cpus[pos], num->os[chain]);
+		cpumask_set_cpu(pos, num->logical[chain]);
+	}
+
+	dprintf("%s: %d chains\n", __FUNCTION__, num->nr_chains);
+	ret = 0;
+
+out:
+	free(last);
+	free(cpus);
+	return ret;
+}
+
+/*
+ * Translate a mask of logical CPU numbers to OS ones, or the other way
+ * around if to_logical is set. Numbers without a counterpart are
+ * dropped. dst may not be src.
+ */
+static int remap_cpus(struct cpu_numbering *num, struct cpumask *dst,
+		const struct cpumask *src, int to_logical)
+{
+	struct cpumask *part, *mapped;
+	struct cpumask *from, *to;
+	int chain;
+	int ret = 0;
+
+	part = cpumask_alloc();
+	mapped = cpumask_alloc();
+	if (!part || !mapped) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	cpumask_clear(dst);
+	for (chain = 0; chain < num->nr_chains; ++chain) {
+		from = to_logical ? num->os[chain] : num->logical[chain];
+		to = to_logical ? num->logical[chain] : num->os[chain];
+
+		cpumask_and(part, src, from);
+		bitmap_remap(cpumask_bits(mapped), cpumask_bits(part),
+				cpumask_bits(from), cpumask_bits(to), nr_cpu_ids);
+		cpumask_or(dst, dst, mapped);
+	}
+
+out:
+	cpumask_free(mapped);
+	cpumask_free(part);
+	return ret;
+}
+
+/*
+ * Turn a mask of logical CPU numbers into OS ones in place, collecting
+ * the topology if needed.
+ */
+static int logical_to_os_cpus(struct part_exec *pe, struct cpumask *cpus)
+{
+	struct cpumask *logical;
+	int ret;
+
+	if (collect_topology() < 0) {
+		fprintf(stderr, "%s: error: collecting topology information\n",
+				__FUNCTION__);
+		return -EINVAL;
+	}
+
+	ret = order_topology(pe_cpu_order(pe));
+	if (ret < 0)
+		return ret;
+
+	ret = setup_cpu_numbering(&cpu_numbering, pe_cpu_order(pe));
+	if (ret < 0)
+		return ret;
+
+	logical = cpumask_alloc();
+	if (!logical) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	cpumask_copy(logical, cpus);
+	ret = remap_cpus(&cpu_numbering, cpus, logical, 0);
+	cpumask_free(logical);
+	return ret;
+}
+
+/*
+ * Print a comma separated list of OS CPU numbers, as exported for the
+ * thread library, in logical numbers keeping the order.
+ */
+static void scn_logical_list(char *buf, int len, const char *list,
+		const int *cpu_order)
+{
+	char *end;
+	long cpu;
+	int n = 0;
+
+	buf[0] = '\0';
+	while (*list && n < len - 1) {
+		cpu = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		list = *end == ',' ? end + 1 : end;
+
+		if (cpu < 0 || cpu >= nr_cpu_ids || cpu_order[cpu] >= nr_cpu_ids)
+			continue;
+
+		n += snprintf(buf + n, len - n, "%s%d", n ? "," : "",
+				cpu_order[cpu]);
+		if (n > len - 1)
+			n = len - 1;
+	}
+}
+
+/*
+ * Find the available CPU closest to a set of CPUs: one sharing a cache
+ * with any of them, iterating caches from the most inner one outwards,
+ * then one from the same NUMA node, or simply the first unused one.
+ * Returns -1 if no CPU is available.
+ */
+static int find_cpu_near(const struct cpumask *set,
+		const struct cpumask *cpus_available)
+{
+	struct cpu_topology *cpu_top;
+	struct cache_topology *cache_top;
+	int index, cpu, near_cpu;
+
+	if (cpumask_empty(cpus_available))
+		return -1;
+
+	for (index = 0; index < 10; ++index) {
+		for_each_cpu(near_cpu, set) {
+			cpu_top = get_cpu_topology(near_cpu);
+			if (!cpu_top)
+				continue;
+
+			list_for_each_entry(cache_top, &cpu_top->cache_topology_list, list) {
+				if (cache_top->index != index)
+					continue;
+
+				for_each_cpu(cpu, cache_top->shared_cpu_map) {
+					if (cpumask_test_cpu(cpu, cpus_available)) {
+						dprintf("%s: CPU %d (same cache L%lu)\n",
+								__FUNCTION__, cpu, cache_top->level);
+						return cpu;
 					}
 				}
+			}
+		}
+	}
+
+	for_each_cpu(near_cpu, set) {
+		cpu_top = get_cpu_topology(near_cpu);
+		if (!cpu_top)
+			continue;
+
+		for_each_cpu(cpu, cpus_available) {
+			struct cpu_topology *top = get_cpu_topology(cpu);
+
+			if (top && top->node_id == cpu_top->node_id) {
+				dprintf("%s: CPU %d (same NUMA)\n", __FUNCTION__, cpu);
+				return cpu;
+			}
+		}
+	}
+
+	cpu = cpumask_first(cpus_available);
+	dprintf("%s: CPU %d (unused)\n", __FUNCTION__, cpu);
+	return cpu;
+}
+
+/*
+ * Reserve nr_cpus helper CPUs close to the CPUs in near.
+ */
+static int reserve_helpers(struct cpumask *helpers, int nr_cpus,
+		const struct cpumask *near, struct cpumask *cpus_available)
+{
+	struct cpumask *around;
+	int cpu;
+
+	around = cpumask_alloc();
+	if (!around) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	cpumask_copy(around, near);
+	cpumask_clear(helpers);
+
+	while (nr_cpus--) {
+		cpu = find_cpu_near(around, cpus_available);
+		if (cpu < 0) {
+			fprintf(stderr, "%s: warning: not enough CPUs for helpers\n",
+					__FUNCTION__);
+			break;
+		}
+
+		cpumask_clear_cpu(cpu, cpus_available);
+		cpumask_set_cpu(cpu, helpers);
+		cpumask_set_cpu(cpu, around);
+	}
+
+	cpumask_free(around);
+	return 0;
+}
+
+/*
+ * The last level cache shared by a CPU, NULL if unknown.
+ */
+static const struct cpumask *llc_domain(struct cpu_topology *cpu_top)
+{
+	struct cache_topology *cache_top;
+	const struct cpumask *domain = NULL;
+
+	list_for_each_entry(cache_top, &cpu_top->cache_topology_list, list) {
+		if (strcmp(cache_top->type, "Instruction"))
+			domain = cache_top->shared_cpu_map;
+	}
+
+	return domain;
+}
+
+/*
+ * First CPU of a set in topological order, -1 if the set is empty.
+ */
+static int first_cpu_in_order(struct part_exec *pe, const struct cpumask *set)
+{
+	int *cpu_order = pe_cpu_order(pe);
+	int cpu, first = -1;
+
+	for_each_cpu(cpu, set) {
+		if (first == -1 || cpu_order[cpu] < cpu_order[first])
+			first = cpu;
+	}
+
+	return first;
+}
+
+/*
+ * Pick the CPU a rank of size CPUs starts from: the last level cache
+ * domain with the fewest available CPUs that still fits the whole
+ * rank (best fit), or simply the first available CPU if none does.
+ */
+static int find_first_cpu(struct part_exec *pe, int size,
+		const struct cpumask *cpus_available)
+{
+	struct cpu_topology *cpu_top;
+	const struct cpumask *domain, *best = NULL;
+	struct cpumask *seen, *free;
+	int nr_free, best_free = INT_MAX;
+	int cpu;
+
+	seen = cpumask_alloc();
+	free = cpumask_alloc();
+	if (!seen || !free) {
+		/* Not fatal, just start from the first available CPU */
+		cpu = first_cpu_in_order(pe, cpus_available);
+		goto out;
+	}
+
+	list_for_each_entry(cpu_top, &cpu_topology_list, list) {
+		if (!cpumask_test_cpu(cpu_top->cpu_id, cpus_available) ||
+				cpumask_test_cpu(cpu_top->cpu_id, seen))
+			continue;
+
+		domain = llc_domain(cpu_top);
+		if (!domain)
+			continue;
+
+		cpumask_or(seen, seen, domain);
+		cpumask_and(free, domain, cpus_available);
+		nr_free = cpumask_weight(free);
+		if (nr_free >= size && nr_free < best_free) {
+			best_free = nr_free;
+			best = domain;
+		}
+	}
+
+	if (best) {
+		cpumask_and(free, best, cpus_available);
+		cpu = first_cpu_in_order(pe, free);
+	}
+	else {
+		cpu = first_cpu_in_order(pe, cpus_available);
+	}
+
+out:
+	cpumask_free(free);
+	cpumask_free(seen);
+	return cpu;
+}
+
+/*
+ * Number of CPUs of each rank: the explicitly requested ones and an
+ * even share of the rest for others, but at least one CPU each
+ * (oversubscribing the node if necessary).
+ */
+static int compute_rank_sizes(struct part_exec *pe, int *sizes)
+{
+	int nr_cpus = cpumask_weight(pe_cpus_available(pe));
+	int nr_default = 0, requested = 0, share = 0;
+	long nr_helpers = 0;
+	int rank;
+
+	if (pe->helper_mode == HELPER_PER_RANK)
+		nr_helpers = (long)pe->helper_cpus * pe->nr_processes;
+	else if (pe->helper_mode == HELPER_PER_NODE)
+		nr_helpers = pe->helper_cpus;
+
+	/* Helpers may not take the CPUs the ranks need themselves */
+	if (nr_helpers && nr_helpers + pe->nr_processes > nr_cpus) {
+		fprintf(stderr, "%s: error: --helper-cpus: %ld helper CPUs and "
+				"%d ranks need at least %ld CPUs, but only %d "
+				"available\n", __FUNCTION__, nr_helpers,
+				pe->nr_processes, nr_helpers + pe->nr_processes,
+				nr_cpus);
+		return -EINVAL;
+	}
+	nr_cpus -= nr_helpers;
+
+	for (rank = 0; rank < pe->nr_processes; ++rank) {
+		if (pe_tpp(pe)[rank])
+			requested += pe_tpp(pe)[rank];
+		else
+			++nr_default;
+	}
+
+	if (requested > nr_cpus) {
+		fprintf(stderr, "%s: error: %d CPUs requested, but only %d available\n",
+				__FUNCTION__, requested, nr_cpus);
+		return -EINVAL;
+	}
+
+	if (nr_default)
+		share = (nr_cpus - requested) / nr_default;
+	if (share < 1)
+		share = 1;
+
+	for (rank = 0; rank < pe->nr_processes; ++rank) {
+		sizes[rank] = pe_tpp(pe)[rank] ? pe_tpp(pe)[rank] : share;
+		dprintf("%s: rank %d: %d CPUs\n", __FUNCTION__, rank, sizes[rank]);
+	}
+
+	return 0;
+}
+
+/*
+ * Assign size CPUs to cpus_to_use, starting from the best fitting cache domain
+ * and continuing with the CPU closest to the last one. cpus_prev is
+ * scratch space.
+ */
+static void assign_cpus_near(struct part_exec *pe, int size,
+		struct cpumask *cpus_available, struct cpumask *cpus_to_use,
+		struct cpumask *cpus_prev)
+{
+	int cpu, cpu_prev = -1, cpus_assigned;
+
+	cpu = find_first_cpu(pe, size, cpus_available);
+
+	for (cpus_assigned = 0; cpus_assigned < size; ++cpus_assigned) {
+		/* Out of CPUs? Oversubscribe */
+		if (cpu < 0) {
+			dprintf("%s: oversubscribing\n", __FUNCTION__);
+			cpumask_xor(cpus_available, pe_cpus_available(pe),
+					cpus_to_use);
+
+			if (cpus_assigned == 0) {
+				cpu = find_first_cpu(pe, size, cpus_available);
+			}
+			else {
+				cpumask_clear(cpus_prev);
+				cpumask_set_cpu(cpu_prev, cpus_prev);
+				cpu = find_cpu_near(cpus_prev, cpus_available);
+			}
+
+			if (cpu < 0)
+				break;
+		}
+
+		cpumask_clear_cpu(cpu, cpus_available);
+		cpumask_set_cpu(cpu, cpus_to_use);
+		dprintf("%s: CPU %d assigned\n", __FUNCTION__, cpu);
+
+		/* Continue with the CPU closest to the last one */
+		cpu_prev = cpu;
+		cpumask_clear(cpus_prev);
+		cpumask_set_cpu(cpu, cpus_prev);
+		cpu = find_cpu_near(cpus_prev, cpus_available);
+	}
+}
+
+/*
+ * Block placement (--blocks) treats the available CPUs as an allocator.
+ * Positions are the topological order of order_topology(), in which
+ * last level cache domains are consecutive, so with equally sized
+ * domains a domain starts at every multiple of the domain size. Ranks
+ * that fit into a domain get a block aligned to their size within it
+ * (or unaligned if it doesn't divide the domain, e.g., 4 CPUs of a 6
+ * core CCD), larger ones a block starting at a domain boundary. Blocks
+ * are found in a bitmap of taken positions without looking at the
+ * topology of individual CPUs. Nodes with cache domains of different
+ * sizes have no such grid, they fall back to the nearest CPU placement.
+ */
+struct cpu_blocks {
+	/* Taken (or nonexistent) positions */
+	unsigned long *taken;
+	/* CPU at each position */
+	int *cpus;
+	int *cpu_order;
+	/* CPUs per last level cache domain */
+	int domain;
+	/* Out of CPUs, blocks that don't fit aren't worth reporting */
+	int oversubscribed;
+};
+
+static int cpu_blocks_init(struct part_exec *pe, struct cpu_blocks *blocks,
+		const struct cpumask *cpus_available)
+{
+	struct cpu_topology *cpu_top;
+	const struct cpumask *domain;
+	int cpu, pos;
+
+	blocks->cpu_order = pe_cpu_order(pe);
+	blocks->taken = malloc(sizeof(unsigned long) * BITS_TO_LONGS(nr_cpu_ids));
+	blocks->cpus = malloc(sizeof(int) * nr_cpu_ids);
+	if (!blocks->taken || !blocks->cpus) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	bitmap_fill(blocks->taken, nr_cpu_ids);
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		/* CPUs without topology information are never in a block */
+		pos = blocks->cpu_order[cpu];
+		if (pos >= nr_cpu_ids)
+			continue;
+
+		blocks->cpus[pos] = cpu;
+		if (cpumask_test_cpu(cpu, cpus_available))
+			clear_bit(pos, blocks->taken);
+	}
+
+	blocks->domain = 0;
+	list_for_each_entry(cpu_top, &cpu_topology_list, list) {
+		domain = llc_domain(cpu_top);
+		if (!domain)
+			continue;
+
+		if (!blocks->domain) {
+			blocks->domain = cpumask_weight(domain);
+		}
+		else if (cpumask_weight(domain) != blocks->domain) {
+			fprintf(stderr, "%s: warning: cache domains of %d and %d "
+					"CPUs, placing ranks without blocks\n",
+					__FUNCTION__, blocks->domain,
+					cpumask_weight(domain));
+			return -EINVAL;
+		}
+	}
+
+	if (!blocks->domain)
+		blocks->domain = 1;
+
+	dprintf("%s: cache domains of %d CPUs\n", __FUNCTION__, blocks->domain);
+	return 0;
+}
+
+static void cpu_blocks_free(struct cpu_blocks *blocks)
+{
+	free(blocks->cpus);
+	free(blocks->taken);
+}
+
+static inline int is_power_of_two(int n)
+{
+	return n > 0 && !(n & (n - 1));
+}
+
+/*
+ * Take a block of size CPUs and add them to cpus, -ENOMEM if there is
+ * no block of that shape left.
+ */
+static int cpu_blocks_alloc(struct cpu_blocks *blocks, int size,
+		struct cpumask *cpus)
+{
+	int domain = blocks->domain;
+	int pos, i;
+
+	if (size <= domain && is_power_of_two(size) &&
+			is_power_of_two(domain)) {
+		pos = bitmap_find_free_region(blocks->taken, nr_cpu_ids,
+				__ffs(size));
+	}
+	else if (size <= domain) {
+		pos = bitmap_find_free_block(blocks->taken, nr_cpu_ids, size,
+				domain % size ? 1 : size, domain);
+	}
+	else {
+		pos = bitmap_find_free_block(blocks->taken, nr_cpu_ids, size,
+				domain, 0);
+	}
+
+	if (pos < 0)
+		return pos;
+
+	for (i = pos; i < pos + size; ++i)
+		cpumask_set_cpu(blocks->cpus[i], cpus);
+
+	return 0;
+}
+
+/* Mark CPUs assigned outside of blocks taken */
+static void cpu_blocks_take(struct cpu_blocks *blocks,
+		const struct cpumask *cpus)
+{
+	int cpu;
+
+	for_each_cpu(cpu, cpus) {
+		if (blocks->cpu_order[cpu] < nr_cpu_ids)
+			set_bit(blocks->cpu_order[cpu], blocks->taken);
+	}
+}
+
+/*
+ * Report the free positions when a block didn't fit, unless there are
+ * fewer free CPUs than asked for. Ranks are oversubscribed from then on
+ * and fragmentation is beside the point.
+ */
+static void cpu_blocks_report(struct cpu_blocks *blocks, int rank, int size)
+{
+	int pos = 0, end;
+	int nr_free = 0, nr_fragments = 0, largest = 0;
+
+	if (blocks->oversubscribed)
+		return;
+
+	for (;;) {
+		pos = find_next_zero_bit(blocks->taken, nr_cpu_ids, pos);
+		if (pos >= nr_cpu_ids)
+			break;
+
+		end = find_next_bit(blocks->taken, nr_cpu_ids, pos);
+		nr_free += end - pos;
+		++nr_fragments;
+		if (end - pos > largest)
+			largest = end - pos;
+		pos = end;
+	}
+
+	if (nr_free < size) {
+		blocks->oversubscribed = 1;
+		return;
+	}
+
+	fprintf(stderr, "%s: warning: rank %d: no block of %d CPUs "
+			"(cache domains of %d), %d CPUs free in %d fragments, "
+			"largest %d\n", __FUNCTION__, rank, size, blocks->domain,
+			nr_free, nr_fragments, largest);
+}
+
+/*
+ * Compute the CPU set of each rank.
+ * Larger ranks are placed first so that they get intact cache domains
+ * and smaller ones fill in the gaps.
+ * Requires topology information to be collected.
+ */
+static int plan_partitions(struct part_exec *pe)
+{
+	struct cpumask *cpus_available = NULL;
+	struct cpumask *cpus_to_use = NULL;
+	struct cpumask *cpus_prev = NULL;
+	struct cpumask *helpers = NULL;
+	struct cpu_blocks blocks = { NULL, NULL, NULL, 0, 0 };
+	unsigned long *ranks = NULL;
+	int *sizes = NULL;
+	int use_blocks = pe->block_placement;
+	int cpu;
+	int i, rank;
+	int ret = 0;
+
+	cpus_available = cpumask_alloc();
+	cpus_to_use = cpumask_alloc();
+	cpus_prev = cpumask_alloc();
+	helpers = cpumask_alloc();
+	ranks = malloc(sizeof(*ranks) * pe->nr_processes);
+	sizes = malloc(sizeof(*sizes) * pe->nr_processes);
+	if (!cpus_available || !cpus_to_use || !cpus_prev || !helpers ||
+			!ranks || !sizes) {
+		fprintf(stderr, "%s: error: allocating cpu masks\n", __FUNCTION__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	cpumask_copy(cpus_available, pe_cpus_available(pe));
+	pe->ranges_used = 0;
+
+	ret = order_topology(pe_cpu_order(pe));
+	if (ret < 0) {
+		goto out;
+	}
+
+	ret = compute_rank_sizes(pe, sizes);
+	if (ret < 0) {
+		goto out;
+	}
+
+	/* Sort ranks by decreasing size, keeping rank order for equal sizes */
+	for (rank = 0; rank < pe->nr_processes; ++rank) {
+		ranks[rank] = ((unsigned long)(INT_MAX - sizes[rank]) << 32) | rank;
+	}
+	qsort(ranks, pe->nr_processes, sizeof(*ranks), ulong_cmp);
+
+	if (use_blocks) {
+		ret = cpu_blocks_init(pe, &blocks, cpus_available);
+		/* Cache domains of different sizes, warned already */
+		if (ret == -EINVAL)
+			use_blocks = 0;
+		else if (ret < 0)
+			goto out;
+		ret = 0;
+	}
+
+	for (i = 0; i < pe->nr_processes; ++i) {
+		rank = ranks[i] & 0xffffffffUL;
+		cpumask_clear(cpus_to_use);
+
+		if (use_blocks) {
+			ret = cpu_blocks_alloc(&blocks, sizes[rank], cpus_to_use);
+			if (ret < 0)
+				cpu_blocks_report(&blocks, rank, sizes[rank]);
+			else
+				cpumask_andnot(cpus_available, cpus_available,
+						cpus_to_use);
+		}
+
+		if (!use_blocks || ret < 0) {
+			assign_cpus_near(pe, sizes[rank], cpus_available,
+					cpus_to_use, cpus_prev);
+		}
+		dprintf("%s: rank %d: %d CPUs assigned\n", __FUNCTION__, rank,
+				cpumask_weight(cpus_to_use));
+
+		ret = pe_store_cpus(pe, cpus_to_use,
+				&pe_plans(pe)[rank].affinity_off);
+		if (ret < 0)
+			goto out;
+
+		cpumask_clear(helpers);
+		if (pe->helper_mode == HELPER_PER_RANK) {
+			ret = reserve_helpers(helpers, pe->helper_cpus,
+					cpus_to_use, cpus_available);
+			if (ret < 0)
+				goto out;
+		}
+
+		if (pe->helper_mode != HELPER_PER_NODE) {
+			ret = pe_store_cpus(pe, helpers,
+					&pe_plans(pe)[rank].helpers_off);
+			if (ret < 0)
+				goto out;
+		}
+
+		if (use_blocks) {
+			cpu_blocks_take(&blocks, cpus_to_use);
+			cpu_blocks_take(&blocks, helpers);
+		}
+	}
+
+	/* Node helpers are shared by all ranks */
+	if (pe->helper_mode == HELPER_PER_NODE) {
+		cpu = cpumask_first(cpus_available);
+		if (cpu < nr_cpu_ids) {
+			cpumask_clear(cpus_prev);
+			cpumask_set_cpu(cpu, cpus_prev);
+		}
+
+		ret = reserve_helpers(helpers, pe->helper_cpus,
+				cpus_prev, cpus_available);
+		if (ret < 0)
+			goto out;
+
+		ret = pe_store_cpus(pe, helpers, &pe_plans(pe)[0].helpers_off);
+		if (ret < 0)
+			goto out;
+
+		for (rank = 1; rank < pe->nr_processes; ++rank) {
+			pe_plans(pe)[rank].helpers_off = pe_plans(pe)[0].helpers_off;
+		}
+	}
+
+	/* Commit unused cores to shared memory */
+	cpumask_copy(pe_cpus_available(pe), cpus_available);
+
+out:
+	cpu_blocks_free(&blocks);
+	free(sizes);
+	free(ranks);
+	cpumask_free(helpers);
+	cpumask_free(cpus_prev);
+	cpumask_free(cpus_to_use);
+	cpumask_free(cpus_available);
+	return ret;
+}
+
+/*
+ * Bind the calling process to its CPUs, helper CPUs included (see
+ * struct rank_placement).
+ */
+static int bind_process(const struct cpurange *cpus)
+{
+	char cpu_list[PAGE_SIZE];
+	struct cpumask *mask;
+	int ret = 0;
+
+	mask = cpumask_alloc();
+	if (!mask) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	cpurange_to_cpumask(mask, cpus);
+	if (sched_setaffinity_mask(0, mask) < 0) {
+		fprintf(stderr, "%s: error: setting CPU affinity\n",
+				__FUNCTION__);
+		ret = -EINVAL;
+		goto out;
+	}
+	trace_point(TRACE_SETAFFINITY);
+
+	cpurange_scnlistprintf(cpu_list, sizeof(cpu_list), cpus);
+	dprintf("%s: bound to CPUs: %s\n", __FUNCTION__, cpu_list);
+
+out:
+	cpumask_free(mask);
+	return ret;
+}
+
+/*
+ * Order the CPUs of a set by their topological position.
+ * Returns the number of CPUs stored in cpus.
+ */
+static int order_cpus(struct part_exec *pe, const struct cpumask *set,
+		int *cpus)
+{
+	int *cpu_order = pe_cpu_order(pe);
+	unsigned long *keys;
+	int cpu, nr_cpus = 0;
+	int i;
+
+	keys = malloc(sizeof(*keys) * cpumask_weight(set));
+	if (!keys) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	for_each_cpu(cpu, set) {
+		keys[nr_cpus++] = ((unsigned long)cpu_order[cpu] << 32) | cpu;
+	}
+
+	qsort(keys, nr_cpus, sizeof(*keys), ulong_cmp);
+
+	for (i = 0; i < nr_cpus; ++i) {
+		cpus[i] = keys[i] & 0xffffffffUL;
+	}
+
+	free(keys);
+	return nr_cpus;
+}
+
+/*
+ * What a process takes away from the plan. Once the last process of an
+ * epoch leaves, the next planner rewrites the plan in the segment, so
+ * everything needed after leaving is copied here first.
+ */
+struct rank_placement {
+	int rank;
+	struct cpumask *affinity;
+	struct cpumask *helpers;
+	/* Both merged, the CPUs the process is bound to */
+	struct cpurange *bound;
+	/* Affinity in topological order */
+	int *cpus;
+	int nr_cpus;
+	/* Topological position of each CPU, for logical numbers */
+	int *cpu_order;
+};
+
+static void placement_free(struct rank_placement *pl)
+{
+	cpumask_free(pl->affinity);
+	cpumask_free(pl->helpers);
+	cpurange_free(pl->bound);
+	free(pl->cpus);
+	free(pl->cpu_order);
+	memset(pl, 0, sizeof(*pl));
+}
+
+static int placement_alloc(struct rank_placement *pl)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->affinity = cpumask_alloc();
+	pl->helpers = cpumask_alloc();
+	/* Room for any set of CPUs */
+	pl->bound = cpurange_alloc((nr_cpu_ids + 1) / 2);
+	pl->cpus = malloc(sizeof(*pl->cpus) * nr_cpu_ids);
+	pl->cpu_order = malloc(sizeof(*pl->cpu_order) * nr_cpu_ids);
+	if (!pl->affinity || !pl->helpers || !pl->bound || !pl->cpus ||
+			!pl->cpu_order) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		placement_free(pl);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Copy the plan of a rank, pe must not change meanwhile */
+static int placement_take(struct rank_placement *pl, struct part_exec *pe,
+		int rank)
+{
+	int ret;
+
+	pl->rank = rank;
+	pe_rank_cpus(pe, rank, pl->affinity, pl->helpers);
+	ret = cpurange_or(pl->bound, pe_affinity(pe, rank), pe_helper(pe, rank));
+	if (ret < 0)
+		return ret;
+	memcpy(pl->cpu_order, pe_cpu_order(pe),
+			sizeof(*pl->cpu_order) * nr_cpu_ids);
+	pl->nr_cpus = order_cpus(pe, pl->affinity, pl->cpus);
+	if (pl->nr_cpus <= 0)
+		return pl->nr_cpus < 0 ? pl->nr_cpus : -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Abort the partitioned execution and wake up everyone waiting for it.
+ * Called with pe->lock held, unless the lock itself is broken.
+ */
+static void abort_partitions(struct part_exec *pe)
+{
+	pe->aborted = 1;
+	__atomic_add_fetch(&pe->generation, 1, __ATOMIC_RELEASE);
+	futex_wake_all(&pe->generation);
+}
+
+/*
+ * Take the lock, returns 0 with the lock held. If its owner died holding
+ * it the shared state can't be trusted anymore, so the partitioned
+ * execution is aborted and an error returned without the lock held. The
+ * same goes for any other error, e.g., ENOTRECOVERABLE, though the abort
+ * is then done without the lock.
+ */
+static int lock_partitions(struct part_exec *pe)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&pe->lock);
+	if (ret == 0)
+		return 0;
+
+	if (ret == EOWNERDEAD) {
+		fprintf(stderr, "%s: error: a process died holding the lock\n",
+				__FUNCTION__);
+		pthread_mutex_consistent(&pe->lock);
+		abort_partitions(pe);
+		pthread_mutex_unlock(&pe->lock);
+		return -EOWNERDEAD;
+	}
+
+	fprintf(stderr, "%s: error: locking: %s\n", __FUNCTION__, strerror(ret));
+	abort_partitions(pe);
+	return -ret;
+}
+
+/*
+ * Read /proc/<pid>/stat and return the fields following the command
+ * name, i.e., starting with the state. NULL if there is no such process.
+ */
+static char *read_proc_stat(pid_t pid, char *stat, int size)
+{
+	char path[64];
+	char *fields;
+	int fd, len;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	len = read(fd, stat, size - 1);
+	close(fd);
+	if (len <= 0)
+		return NULL;
+	stat[len] = '\0';
+
+	/* The command name may contain anything, it ends at the last ')' */
+	fields = strrchr(stat, ')');
+	if (!fields || fields[1] != ' ')
+		return NULL;
+
+	return fields + 2;
+}
+
+/*
+ * Dead or zombie, a zombie still answers to kill(pid, 0) until the
+ * launcher reaps it.
+ */
+static int process_dead(pid_t pid)
+{
+	char stat[512];
+	char *state;
+
+	if (kill(pid, 0) < 0 && errno == ESRCH)
+		return 1;
+
+	state = read_proc_stat(pid, stat, sizeof(stat));
+	if (!state)
+		return errno == ENOENT;
+
+	return state[0] == 'Z' || state[0] == 'X';
+}
+
+/*
+ * Start time of a process in clock ticks since boot, tells apart
+ * processes with a recycled PID. 0 if the process is gone.
+ */
+static unsigned long process_start_time(pid_t pid)
+{
+	char stat[512];
+	char *field;
+	int i;
+
+	field = read_proc_stat(pid, stat, sizeof(stat));
+	if (!field)
+		return 0;
+
+	/* starttime is field 22, the state is field 3 */
+	for (i = 3; i < 22 && field; ++i) {
+		field = strchr(field, ' ');
+		if (field)
+			++field;
+	}
+
+	return field ? strtoul(field, NULL, 10) : 0;
+}
+
+/*
+ * The process of a filled in slot is gone, or its PID has been recycled
+ * by another process meanwhile.
+ */
+static int slot_dead(const struct process_list_item *pli)
+{
+	unsigned long start_time;
+
+	if (process_dead(pli->pid))
+		return 1;
+
+	start_time = process_start_time(pli->pid);
+	return pli->start_time && start_time && start_time != pli->start_time;
+}
+
+/*
+ * Interval of the checks for dead ranks: RENDEZVOUS_CHECK_MS per rank per
+ * online CPU, so that on oversubscribed nodes the waiters don't starve
+ * the arrival of the others, but at most RENDEZVOUS_CHECK_MAX_MS.
+ */
+static long rendezvous_check_ms(int ppn, int nr_online)
+{
+	long check_ms;
+
+	check_ms = RENDEZVOUS_CHECK_MS * ((ppn + nr_online - 1) / nr_online);
+	if (check_ms > RENDEZVOUS_CHECK_MAX_MS)
+		check_ms = RENDEZVOUS_CHECK_MAX_MS;
+
+	return check_ms;
+}
+
+/*
+ * Each waiting process watches the process in the next slot, the one in
+ * the last slot computes the plan. Returns the PID of the watched process
+ * if it died, 0 otherwise.
+ */
+static pid_t neighbour_dead(struct part_exec *pe, int my_i, int nr_slots)
+{
+	struct process_list_item *pli = &pe_processes(pe)[(my_i + 1) % nr_slots];
+	pid_t pid;
+
+	if (!__atomic_load_n(&pli->ready, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pid = pli->pid;
+	return pid && slot_dead(pli) ? pid : 0;
+}
+
+/*
+ * Wait until every slot below nr_slots has been filled in, sleeping on
+ * the arrival counter. Whenever no one arrived for check_ms the processes
+ * that did fill in their slot are checked for being alive, a dead one
+ * would never pick up its plan.
+ */
+static int wait_for_slots(struct part_exec *pe, int nr_slots, long timeout_ms,
+		long check_ms)
+{
+	struct timespec start, now;
+	long left_ms;
+	int arrivals;
+	pid_t pid;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_slots; ++i) {
+		for (;;) {
+			/* Read before the slot, so that no arrival is missed */
+			arrivals = __atomic_load_n(&pe->arrivals, __ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&pe_processes(pe)[i].ready,
+						__ATOMIC_ACQUIRE))
+				break;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left_ms = timeout_ms - timespec_diff_ns(&now, &start) / 1000000L;
+			if (left_ms <= 0)
+				return -ETIMEDOUT;
+
+			if (futex_wait_change(&pe->arrivals, arrivals, 0,
+						check_ms < left_ms ? check_ms : left_ms) == 0)
+				continue;
+
+			for (j = 0; j < nr_slots; ++j) {
+				if (!__atomic_load_n(&pe_processes(pe)[j].ready,
+							__ATOMIC_ACQUIRE))
+					continue;
+
+				pid = pe_processes(pe)[j].pid;
+				if (pid && slot_dead(&pe_processes(pe)[j])) {
+					fprintf(stderr, "%s: error: process %d died\n",
+							__FUNCTION__, pid);
+					return -ESRCH;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+struct rank_order_key {
+	long key;
+	int pid;
+	int slot;
+};
+
+static int rank_order_key_cmp(const void *a, const void *b)
+{
+	const struct rank_order_key *x = a;
+	const struct rank_order_key *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+
+	return x->pid - y->pid;
+}
+
+/*
+ * Assign node-local ranks in order of the processes' keys, see
+ * --rank-order. PIDs break ties.
+ */
+static int rank_processes(struct part_exec *pe)
+{
+	struct rank_order_key *keys;
+	int i;
+
+	keys = malloc(sizeof(*keys) * pe->nr_processes);
+	if (!keys) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < pe->nr_processes; ++i) {
+		keys[i].key = pe_processes(pe)[i].key;
+		keys[i].pid = pe_processes(pe)[i].pid;
+		keys[i].slot = i;
+	}
+
+	qsort(keys, pe->nr_processes, sizeof(*keys), rank_order_key_cmp);
+
+	for (i = 0; i < pe->nr_processes; ++i) {
+		pe_processes(pe)[keys[i].slot].rank = i;
+	}
+
+	free(keys);
+	return 0;
+}
+
+/*
+ * CPU ledger of a user on the node, shared by all of the user's mpipin
+ * jobs that opt in with --share-node. It records the owner of each CPU so
+ * that jobs started later place their ranks around the CPUs in use. There
+ * is no release, entries whose owner exited are simply reclaimed by the
+ * next job.
+ *
+ * The ledger holds a robust mutex and the claims, so it is private to its
+ * user: a ledger writable by others could be wedged or forged. Hence jobs
+ * of different users don't see each other's claims, keeping those apart
+ * is left to the resource manager (cgroups, cpusets) of shared nodes.
+ */
+#define LEDGER_PATH	"/mpipin.ledger.%u"
+#define LEDGER_VERSION	2
+
+struct ledger_entry {
+	/* Process bound to the CPU */
+	pid_t pid;
+	/* Launcher of the job, i.e., the parent of the ranks */
+	pid_t job;
+	unsigned long start_time;
+};
+
+struct cpu_ledger {
+	unsigned int magic;
+	unsigned int version;
+	pthread_mutex_t lock;
+	/* One entry for each of nr_cpu_ids */
+	struct ledger_entry cpus[0];
+};
+
+struct cpu_ledger *ledger = NULL;
+
+static inline size_t ledger_size(void)
+{
+	return sizeof(struct cpu_ledger) + sizeof(struct ledger_entry) * nr_cpu_ids;
+}
+
+static struct cpu_ledger *open_ledger(void)
+{
+	pthread_mutexattr_t lock_attr;
+	struct cpu_ledger *l = NULL;
+	char path[64];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), LEDGER_PATH, (unsigned int)getuid());
+	fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: error: opening %s\n", __FUNCTION__, path);
+		return NULL;
+	}
+
+	if (flock(fd, LOCK_EX) < 0) {
+		fprintf(stderr, "%s: error: locking %s\n", __FUNCTION__, path);
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: error: stating %s\n", __FUNCTION__, path);
+		goto unlock_out;
+	}
+
+	/* Created by someone else under our name? */
+	if (st.st_uid != getuid() || (st.st_mode & 077)) {
+		fprintf(stderr, "%s: error: %s isn't private to this user\n",
+				__FUNCTION__, path);
+		goto unlock_out;
+	}
+
+	if (st.st_size == 0 && ftruncate(fd, ledger_size()) < 0) {
+		fprintf(stderr, "%s: error: sizing %s\n", __FUNCTION__, path);
+		goto unlock_out;
+	}
+	else if (st.st_size != 0 && st.st_size != (off_t)ledger_size()) {
+		fprintf(stderr, "%s: error: %s has unexpected size\n",
+				__FUNCTION__, path);
+		goto unlock_out;
+	}
+
+	l = mmap(0, ledger_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (l == MAP_FAILED) {
+		fprintf(stderr, "%s: error: mapping %s\n", __FUNCTION__, path);
+		l = NULL;
+		goto unlock_out;
+	}
+
+	if (st.st_size == 0) {
+		pthread_mutexattr_init(&lock_attr);
+		pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&l->lock, &lock_attr);
+		pthread_mutexattr_destroy(&lock_attr);
+
+		l->magic = MPIPIN_MAGIC;
+		l->version = LEDGER_VERSION;
+	}
+	else if (l->magic != MPIPIN_MAGIC || l->version != LEDGER_VERSION) {
+		fprintf(stderr, "%s: error: %s has unknown format\n",
+				__FUNCTION__, path);
+		munmap(l, ledger_size());
+		l = NULL;
+	}
+
+unlock_out:
+	flock(fd, LOCK_UN);
+out:
+	close(fd);
+	return l;
+}
+
+static void lock_ledger(struct cpu_ledger *l)
+{
+	/* Entries are validated one by one, nothing to repair */
+	if (pthread_mutex_lock(&l->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&l->lock);
+}
+
+static void unlock_ledger(struct cpu_ledger *l)
+{
+	pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Remove the CPUs owned by live processes of other jobs from cpus.
+ * Called with the ledger locked.
+ */
+static void ledger_exclude(struct cpu_ledger *l, pid_t job,
+		struct cpumask *cpus)
+{
+	struct ledger_entry *e;
+	unsigned long start_time;
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		e = &l->cpus[cpu];
+		if (!e->pid)
+			continue;
+
+		/*
+		 * Reclaim CPUs of exited processes. A start time of 0 means
+		 * /proc couldn't tell, the claim is kept then.
+		 */
+		start_time = process_start_time(e->pid);
+		if (process_dead(e->pid) ||
+				(start_time && start_time != e->start_time)) {
+			dprintf("%s: CPU %d reclaimed from pid %d\n",
+					__FUNCTION__, cpu, e->pid);
+			memset(e, 0, sizeof(*e));
+			continue;
+		}
+
+		if (e->job != job && cpumask_test_cpu(cpu, cpus)) {
+			dprintf("%s: CPU %d owned by pid %d of job %d\n",
+					__FUNCTION__, cpu, e->pid, e->job);
+			cpumask_clear_cpu(cpu, cpus);
+		}
+	}
+}
+
+/*
+ * Record pid of job as the owner of cpus.
+ * Called with the ledger locked.
+ */
+static void ledger_claim(struct cpu_ledger *l, pid_t job, pid_t pid,
+		const struct cpurange *cpus)
+{
+	unsigned long start_time = process_start_time(pid);
+	int i, cpu;
+
+	for (i = 0; i < cpus->nr_ranges; ++i) {
+		for (cpu = cpus->ranges[i].first;
+				cpu <= cpus->ranges[i].last && cpu < nr_cpu_ids;
+				++cpu) {
+			l->cpus[cpu].pid = pid;
+			l->cpus[cpu].job = job;
+			l->cpus[cpu].start_time = start_time;
+		}
+	}
+}
+
+/*
+ * Plan the partitions around the CPUs other jobs on the node own and
+ * claim the CPUs of the ranks listed in pids (-1 for ranks not to claim).
+ */
+static int plan_shared_node(struct part_exec *pe, const pid_t *pids)
+{
+	pid_t job = getppid();
+	struct cpurange *cpus;
+	int ret, rank;
+
+	if (!ledger)
+		return plan_partitions(pe);
+
+	/* Room for any set of CPUs */
+	cpus = cpurange_alloc((nr_cpu_ids + 1) / 2);
+	if (!cpus) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	lock_ledger(ledger);
+
+	ledger_exclude(ledger, job, pe_cpus_available(pe));
+	if (cpumask_empty(pe_cpus_available(pe))) {
+		fprintf(stderr, "%s: error: all CPUs are owned by other jobs\n",
+				__FUNCTION__);
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = plan_partitions(pe);
+	if (ret < 0)
+		goto out;
+
+	for (rank = 0; rank < pe->nr_processes; ++rank) {
+		if (pids[rank] < 0)
+			continue;
+
+		ret = cpurange_or(cpus, pe_affinity(pe, rank),
+				pe_helper(pe, rank));
+		if (ret < 0)
+			goto out;
+		ledger_claim(ledger, job, pids[rank], cpus);
+	}
+
+out:
+	unlock_ledger(ledger);
+	cpurange_free(cpus);
+	return ret;
+}
+
+/*
+ * CPUs available to the partitioned execution: the union of what the
+ * processes are allowed to run on and the CPUs the caller manages to move
+ * to, minus the excluded ones.
+ */
+static int discover_cpus(struct part_exec *pe, int nr_slots,
+		const struct cpumask *excluded, struct cpumask *cpus)
+{
+	struct cpumask *target;
+	int cpu, i;
+
+	target = cpumask_alloc();
+	if (!target) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	cpumask_clear(cpus);
+	for (i = 0; i < nr_slots; ++i) {
+		cpumask_or(cpus, cpus, pe_allowed(pe, i));
+	}
+
+	/* Probe only the CPUs not allowed already */
+	for_each_cpu_not(cpu, cpus) {
+		if (cpumask_test_cpu(cpu, excluded)) {
+			continue;
+		}
+
+		/* Try to move */
+		cpumask_clear(target);
+		cpumask_set_cpu(cpu, target);
+
+		if (sched_setaffinity_mask(0, target) < 0) {
+			continue;
+		}
+
+		if (sched_getcpu() == cpu) {
+			cpumask_set_cpu(cpu, cpus);
+			dprintf("CPU %d has been discovered as available\n", cpu);
+		}
+	}
+
+	/* Unset excluded CPUs.. */
+	cpumask_andnot(cpus, cpus, excluded);
+
+	cpumask_free(target);
+	return 0;
+}
+
+/*
+ * Wait for the previous partitioned executions sharing the segment to
+ * leave.
+ */
+static int wait_for_epoch(struct part_exec *pe, int epoch, long timeout_ms,
+		long check_ms)
+{
+	unsigned long start = get_time_ns();
+	int cur;
+
+	while ((cur = __atomic_load_n(&pe->epoch, __ATOMIC_ACQUIRE)) != epoch) {
+		if (pe->aborted)
+			return -ECANCELED;
+
+		if (get_time_ns() - start >= timeout_ms * 1000000UL)
+			return -ETIMEDOUT;
+
+		futex_wait_change(&pe->epoch, cur, 0, check_ms);
+	}
+
+	return 0;
+}
+
+/*
+ * Compute the plan of the current epoch unless the previous epoch's plan
+ * was made for the same CPUs and settings. Plans aren't cached when
+ * sharing the node with other jobs, as the CPUs they own change.
+ * Called with pe->lock held by the last process to arrive.
+ */
+static int plan_epoch(struct part_exec *pe, int ppn, const int *tpp,
+		const struct cpumask *excluded)
+{
+	struct cpumask *cpus, *excluded_os = NULL;
+	pid_t *pids;
+	int i, ret;
+
+	cpus = cpumask_alloc();
+	if (!cpus) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
+
+	/* Logical numbers need the topology, which is then collected early */
+	if (logical_cpus) {
+		excluded_os = cpumask_alloc();
+		if (!excluded_os) {
+			fprintf(stderr, "%s: error: allocating memory\n",
+					__FUNCTION__);
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		cpumask_copy(excluded_os, excluded);
+		ret = logical_to_os_cpus(pe, excluded_os);
+		if (ret < 0)
+			goto out;
+		excluded = excluded_os;
+	}
+
+	ret = discover_cpus(pe, ppn, excluded, cpus);
+	if (ret < 0)
+		goto out;
+
+	if (!ledger && pe->plan_cached && cpumask_equal(cpus, pe_plan_cpus(pe)) &&
+			pe->helper_mode == helper_mode &&
+			pe->helper_cpus == helper_cpus &&
+			pe->block_placement == block_placement &&
+			!memcmp(pe_tpp(pe), tpp, sizeof(*tpp) * ppn)) {
+		dprintf("%s: reusing the plan of epoch %d\n",
+				__FUNCTION__, pe->epoch - 1);
+		goto out;
+	}
+
+	pe->plan_cached = 0;
+	cpumask_copy(pe_plan_cpus(pe), cpus);
+	cpumask_copy(pe_cpus_available(pe), cpus);
+	pe->helper_mode = helper_mode;
+	pe->helper_cpus = helper_cpus;
+	pe->block_placement = block_placement;
+	memcpy(pe_tpp(pe), tpp, sizeof(*tpp) * ppn);
+
+	/* Collect topology information */
+	if (collect_topology() < 0) {
+		fprintf(stderr, "%s: error: collecting topology information\n",
+				__FUNCTION__);
+		ret = -EINVAL;
+		goto out;
+	}
+	trace_point(TRACE_TOPOLOGY);
+
+	dprintf("%s: topology information collected\n", __FUNCTION__);
+
+	pids = malloc(sizeof(*pids) * ppn);
+	if (!pids) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ppn; ++i) {
+		pids[pe_processes(pe)[i].rank] = pe_processes(pe)[i].pid;
+	}
+
+	ret = plan_shared_node(pe, pids);
+	free(pids);
+	if (ret < 0) {
+		fprintf(stderr, "%s: error: computing CPU partitions\n",
+				__FUNCTION__);
+		goto out;
+	}
+	trace_point(TRACE_PLAN);
+
+	pe->plan_cached = 1;
+out:
+	cpumask_free(excluded_os);
+	cpumask_free(cpus);
+	return ret;
+}
+
+int pin_process(struct part_exec *pe, int ppn, const int *tpp,
+		const struct cpumask *allowed, const struct cpumask *excluded,
+		int ticket, struct rank_placement *pl)
+{
+	struct process_list_item *pli;
+	int ret = 0;
+	int my_i, i;
+	int generation;
+	int epoch;
+	int nr_online;
+	/* Timeout period: 10 secs + (#procs * 0.1sec) */
+	long timeout_ms = (10 + ppn / 10) * 1000L;
+	unsigned long wait_start;
+	long spin_ns, check_ms;
+	pid_t dead;
+
+	if (pe->nr_processes != ppn) {
+		fprintf(stderr, "%s: error: requested number of processes"
+				" doesn't match current partitioned execution\n",
+				__FUNCTION__);
+		return -EINVAL;
+	}
+
+	/* get_nprocs() parses sysfs on each call */
+	nr_online = get_nprocs();
+	spin_ns = ppn <= nr_online ? RENDEZVOUS_SPIN_NS : 0;
+	check_ms = rendezvous_check_ms(ppn, nr_online);
+
+	/* Wait for the partitioned execution of our ticket to start */
+	epoch = ticket / ppn;
+	my_i = ticket % ppn;
+
+	if ((ret = wait_for_epoch(pe, epoch, timeout_ms, check_ms)) < 0) {
+		if (ret == -ETIMEDOUT && lock_partitions(pe) == 0) {
+			if (!pe->aborted) {
+				fprintf(stderr, "%s: error: pid: %d, timed out waiting "
+						"for the previous execution, waking everyone\n",
+						__FUNCTION__, getpid());
+				abort_partitions(pe);
+			}
+			pthread_mutex_unlock(&pe->lock);
+		}
+
+		fprintf(stderr, "%s: error: pid: %d, job startup aborted\n",
+				__FUNCTION__, getpid());
+		ret = -ETIMEDOUT;
+		goto out;
+	}
+
+	/* The plan we wait for is published after our arrival */
+	generation = __atomic_load_n(&pe->generation, __ATOMIC_ACQUIRE);
+
+	/*
+	 * Late for a startup that has been given up already? The aborted
+	 * flag is sticky, arrivals never reset it.
+	 */
+	if (pe->aborted) {
+		fprintf(stderr, "%s: error: pid: %d, job startup aborted\n",
+				__FUNCTION__, getpid());
+		ret = -ETIMEDOUT;
+		goto out;
+	}
+
+	pli = &pe_processes(pe)[my_i];
+	pli->pid = getpid();
+	pli->start_time = process_start_time(pli->pid);
+	pli->key = rank_key;
+	pli->rank = -1;
+	cpumask_copy(pe_allowed(pe, my_i), allowed);
+	__atomic_store_n(&pli->ready, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pe->arrivals, 1, __ATOMIC_RELEASE);
+	futex_wake(&pe->arrivals, 1);
+	trace_point(TRACE_ARRIVAL);
+
+	dprintf("%s: nr_processes: %d, epoch: %d, slot: %d\n",
+			__FUNCTION__, ppn, epoch, my_i);
+
+	/*
+	 * Last process? Compute the plan for everyone, publish it
+	 * and wake up all the others at once
+	 */
+	if (my_i == ppn - 1) {
+		/* Not under the lock, others may need it to abort */
+		ret = wait_for_slots(pe, ppn, timeout_ms, check_ms);
+
+		if (lock_partitions(pe) < 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		/* Given up by a waiter meanwhile? */
+		if (pe->aborted) {
+			fprintf(stderr, "%s: error: pid: %d, job startup aborted\n",
+					__FUNCTION__, getpid());
+			ret = -ETIMEDOUT;
+			goto unlock_out;
+		}
+
+		if (ret < 0 || rank_processes(pe) < 0) {
+			fprintf(stderr, "%s: error: collecting processes\n",
+					__FUNCTION__);
+			abort_partitions(pe);
+			ret = -EINVAL;
+			goto unlock_out;
+		}
+		trace_point(TRACE_RANKED);
+
+		ret = plan_epoch(pe, ppn, tpp, excluded);
+		if (ret < 0) {
+			abort_partitions(pe);
+			goto unlock_out;
+		}
+
+		/* Everyone leaves once it read its plan */
+		pe->nr_processes_left = ppn;
+		__atomic_store_n(&pe->generation, generation + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pe->lock);
+
+		dprintf("%s: plan published, waking everyone\n", __FUNCTION__);
+		futex_wake_all(&pe->generation);
+		trace_point(TRACE_WAKEUP);
+	}
+	/* Otherwise wait for the plan */
+	else {
+		dprintf("%s: pid: %d, waiting for plan\n",
+				__FUNCTION__, getpid());
+		wait_start = get_time_ns();
+		dead = 0;
+
+		/* Wake up periodically to see whether we wait for the dead */
+		while (futex_wait_change(&pe->generation, generation, spin_ns,
+					check_ms) < 0) {
+			spin_ns = 0;
+			dead = neighbour_dead(pe, my_i, ppn);
+			if (!dead && get_time_ns() - wait_start <
+					timeout_ms * 1000000UL)
+				continue;
+
+			/* A broken lock aborts the startup by itself */
+			if (lock_partitions(pe) < 0)
+				break;
+
+			/* First to notice? Wake up everyone else,
+			 * but tell them we gave up */
+			if (pe->generation == generation) {
+				if (dead)
+					fprintf(stderr, "%s: error: pid: %d, process %d died, waking everyone\n",
+							__FUNCTION__, getpid(), dead);
+				else
+					fprintf(stderr, "%s: error: pid: %d, timed out, waking everyone\n",
+							__FUNCTION__, getpid());
+				abort_partitions(pe);
+			}
+
+			pthread_mutex_unlock(&pe->lock);
+			break;
+		}
+
+		if (pe->aborted) {
+			fprintf(stderr, "%s: error: pid: %d, job startup aborted\n",
+					__FUNCTION__, getpid());
+			ret = -ETIMEDOUT;
+			goto out;
+		}
+
+		trace_point(TRACE_WAKEUP);
+		dprintf("%s: pid: %d, woken up\n",
+				__FUNCTION__, getpid());
+	}
+
+	/*
+	 * Take our plan along, no lock needed as it doesn't change until
+	 * the last of us leaves. Nothing may read pe after that.
+	 */
+	ret = placement_take(pl, pe, pli->rank);
+
+	/* Last to leave? Let the next epoch in */
+	if (__atomic_sub_fetch(&pe->nr_processes_left, 1, __ATOMIC_ACQ_REL) == 0 &&
+			lock_partitions(pe) == 0) {
+		dprintf("%s: nr_processes: %d (partitioned exec %d ends)\n",
+				__FUNCTION__, pe->nr_processes, epoch);
+		for (i = 0; i < ppn; ++i) {
+			pe_processes(pe)[i].pid = 0;
+			pe_processes(pe)[i].ready = 0;
+		}
+		__atomic_store_n(&pe->epoch, epoch + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pe->lock);
+		futex_wake_all(&pe->epoch);
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: error: reading the plan of rank %d\n",
+				__FUNCTION__, pl->rank);
+		goto out;
+	}
+
+	dprintf("%s: rank: %d, ret: 0\n", __FUNCTION__, pl->rank);
+	if (bind_process(pl->bound) < 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = pl->rank;
+	goto out;
+
+unlock_out:
+	pthread_mutex_unlock(&pe->lock);
+out:
+	return ret;
+}
+
+/*
+ * Remove segments left behind by crashed launches, i.e., the ones whose
+ * launcher doesn't exist anymore.
+ */
+static void reclaim_stale_segments(pid_t ppid)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int pid, ppn, len;
+
+	dir = opendir("/dev/shm");
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		len = 0;
+		if (sscanf(de->d_name, "mpipin.%d.%d.shm%n", &pid, &ppn,
+					&len) != 2 ||
+				de->d_name[len] != '\0' || len == 0)
+			continue;
+
+		if (pid == ppid || pid <= 0 || !process_dead(pid))
+			continue;
+
+		snprintf(path, sizeof(path), "/%s", de->d_name);
+		if (shm_unlink(path) == 0) {
+			dprintf("%s: removed stale %s\n", __FUNCTION__, path);
+		}
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Remove the segment once its last epoch has started. Processes of the
+ * next step which drew a ticket already keep it, the check is done under
+ * the flock tickets are drawn with, so that a step is never split across
+ * two segments. Only the ticket counter is read, not the plan.
+ */
+static void unlink_segment(struct part_exec *pe, int fd, const char *path,
+		int ppn, int ticket)
+{
+	int end = (ticket / ppn + 1) * ppn;
+	struct stat st;
+
+	if (flock(fd, LOCK_EX) < 0)
+		return;
+
+	/* Gone already? The name may be a newer segment by now */
+	if (fstat(fd, &st) == 0 && st.st_nlink > 0 &&
+			__atomic_load_n(&pe->next_ticket, __ATOMIC_ACQUIRE) <= end) {
+		if (shm_unlink(path) == 0) {
+			dprintf("%s: removed %s\n", __FUNCTION__, path);
+		}
+	}
+
+	flock(fd, LOCK_UN);
+}
+
+/*
+ * Number of tasks of this node's step, parsed from Slurm's compressed
+ * per node list, e.g., "4(x2),3" for 4 tasks on the first two nodes and
+ * 3 on the third. SLURM_NTASKS_PER_NODE is only set with
+ * --ntasks-per-node and has the same format. -1 if unknown.
+ */
+static int slurm_local_size(void)
+{
+	const char *val;
+	char *end;
+	long tasks, repeat;
+	long node;
+
+	val = getenv("SLURM_NODEID");
+	if (!val)
+		return -1;
+	node = strtol(val, &end, 10);
+	if (end == val || *end != '\0' || node < 0)
+		return -1;
+
+	val = getenv("SLURM_STEP_TASKS_PER_NODE");
+	if (!val)
+		return -1;
+
+	while (*val) {
+		tasks = strtol(val, &end, 10);
+		if (end == val || tasks < 0)
+			return -1;
+
+		repeat = 1;
+		if (!strncmp(end, "(x", 2)) {
+			val = end + 2;
+			repeat = strtol(val, &end, 10);
+			if (end == val || *end != ')' || repeat <= 0)
+				return -1;
+			++end;
+		}
+
+		if (node < repeat)
+			return tasks;
+		node -= repeat;
+
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			return -1;
+		val = end;
+	}
+
+	return -1;
+}
+
+/*
+ * Node-local rank and number of ranks as provided by launchers. PMIx
+ * doesn't export the number of local ranks to the environment, -p is
+ * needed there.
+ */
+static const struct {
+	const char *rank;
+	const char *size;
+	/* For sizes that aren't a plain number */
+	int (*get_size)(void);
+} local_rank_env[] = {
+	{ "OMPI_COMM_WORLD_LOCAL_RANK",	"OMPI_COMM_WORLD_LOCAL_SIZE", NULL },	/* Open MPI */
+	{ "MPI_LOCALRANKID",		"MPI_LOCALNRANKS", NULL },		/* MPICH/Hydra */
+	{ "PMIX_LOCAL_RANK",		NULL, NULL },				/* PMIx */
+	{ "SLURM_LOCALID",		NULL, slurm_local_size },		/* Slurm */
+	{ NULL, NULL, NULL },
+};
+
+/*
+ * Look up the node-local rank, size is set to 0 if the launcher
+ * doesn't tell the number of local ranks.
+ */
+static int get_local_rank(int *rank, int *size)
+{
+	char *val, *end;
+	int i;
+
+	for (i = 0; local_rank_env[i].rank; ++i) {
+		val = getenv(local_rank_env[i].rank);
+		if (!val)
+			continue;
+
+		*rank = strtol(val, &end, 10);
+		if (*end != '\0' || *rank < 0)
+			continue;
+
+		*size = 0;
+		val = local_rank_env[i].size ? getenv(local_rank_env[i].size) : NULL;
+		if (val) {
+			*size = strtol(val, &end, 10);
+			if (*end != '\0' || *size < 0)
+				*size = 0;
+		}
+		else if (local_rank_env[i].get_size) {
+			*size = local_rank_env[i].get_size();
+			if (*size < 0)
+				*size = 0;
+		}
+
+		dprintf("%s: %s: %d, size: %d\n", __FUNCTION__,
+				local_rank_env[i].rank, *rank, *size);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Compute the key ordering this process among the ranks of the node.
+ */
+static int get_rank_key(const char *order, long *key)
+{
+	const char *val;
+	char *end;
+	int size;
+	int rank;
+
+	if (!strcmp(order, "pid")) {
+		*key = 0;
+	}
+	else if (!strcmp(order, "key")) {
+		/* Given by --rank-key */
+	}
+	else if (!strcmp(order, "start")) {
+		/*
+		 * mpipin's own CLOCK_MONOTONIC start time in ns. /proc's
+		 * starttime is in clock ticks, ranks launched together would
+		 * tie on it and fall back to PID order.
+		 */
+		*key = start_ts;
+	}
+	else if (!strcmp(order, "env")) {
+		if (get_local_rank(&rank, &size) < 0)
+			return -ENOENT;
+		*key = rank;
+	}
+	else if (!strncmp(order, "env:", 4)) {
+		val = getenv(order + 4);
+		if (!val)
+			return -ENOENT;
+
+		*key = strtol(val, &end, 0);
+		if (end == val || *end != '\0')
+			return -EINVAL;
+	}
+	else {
+		return -EINVAL;
+	}
+
+	dprintf("%s: order: %s, key: %ld\n", __FUNCTION__, order, *key);
+	return 0;
+}
+
+/*
+ * CPUs available to the job on this node, i.e., the online CPUs that
+ * the cpuset of the job allows. Unlike the current affinity, this is
+ * the same for every rank no matter how the launcher bound it.
+ */
+static int get_job_cpus(struct cpumask *cpus)
+{
+	struct cpumask *online;
+	int ret = -EINVAL;
+
+	online = cpumask_alloc();
+	if (!online) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
 
-				if (!cpu_top) {
-					fprintf(stderr, "%s: error: couldn't find CPU topology info\n",
-							__FUNCTION__);
-					ret = -EINVAL;
-					goto unlock_out;
-				}
+	if (read_bitmap_parselist(cpumask_bits(online), nr_cpu_ids,
+				"/sys/devices/system/cpu/online") < 0) {
+		goto out;
+	}
 
-				node = cpu_top->node_id;
-
-				/* Find a core sharing the same cache iterating caches from
-				 * the most inner one outwards */
-				list_for_each_entry(cache_top, &cpu_top->cache_topology_list, list) {
-					for_each_cpu(cpu, &cache_top->shared_cpu_map) {
-						if (CPU_ISSET(cpu, cpus_available)) {
-							CPU_CLR(cpu, cpus_available);
-							CPU_SET(cpu, cpus_to_use);
-
-							cpu_prev = cpu;
-							dprintf("%s: CPU %d assigned (same cache L%lu)\n",
-									__FUNCTION__, cpu, cache_top->level);
-							goto next_cpu;
-						}
-					}
-				}
+	/* The kernel restricts the mask to what our cpuset allows */
+	if (sched_setaffinity_mask(0, online) < 0 ||
+			sched_getaffinity_mask(0, cpus) < 0) {
+		fprintf(stderr, "%s: error: probing CPU affinity\n", __FUNCTION__);
+		goto out;
+	}
 
-				/* Find a CPU from the same NUMA node */
-				for_each_cpu(cpu, cpus_available) {
-					cpu_top = NULL;
-					/* Find the topology object of this CPU */
-					list_for_each_entry(cpu_top_i, &cpu_topology_list, list) {
-						if (cpu_top_i->cpu_id == cpu) {
-							cpu_top = cpu_top_i;
-							break;
-						}
-					}
+	cpumask_and(cpus, cpus, online);
+	ret = 0;
+out:
+	cpumask_free(online);
+	return ret;
+}
 
-					if (!cpu_top) {
-						fprintf(stderr, "%s: error: couldn't find CPU topology info\n",
-								__FUNCTION__);
-						ret = -EINVAL;
-						goto unlock_out;
-					}
+/*
+ * Rendezvous-free pinning: every process computes the same plan from
+ * the topology and the CPUs available to the job, and takes the slot
+ * of its launcher provided node-local rank.
+ */
+static int pin_process_local(struct part_exec *pe, int rank,
+		struct rank_placement *pl)
+{
+	pid_t *pids;
+	int i, ret;
+
+	if (rank >= pe->nr_processes) {
+		fprintf(stderr, "%s: error: local rank %d out of %d processes\n",
+				__FUNCTION__, rank, pe->nr_processes);
+		return -EINVAL;
+	}
 
-					/* Found one */
-					if (node == cpu_top->node_id) {
-						CPU_CLR(cpu, cpus_available);
-						CPU_SET(cpu, cpus_to_use);
+	if (collect_topology() < 0) {
+		fprintf(stderr, "%s: error: collecting topology information\n",
+				__FUNCTION__);
+		return -EINVAL;
+	}
+	trace_point(TRACE_TOPOLOGY);
 
-						cpu_prev = cpu;
-						dprintf("%s: CPU %d assigned (same NUMA)\n",
-								__FUNCTION__, cpu);
-						goto next_cpu;
-					}
-				}
+	/* The other ranks claim their own CPUs */
+	pids = malloc(sizeof(*pids) * pe->nr_processes);
+	if (!pids) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		return -ENOMEM;
+	}
 
-				/* No CPU? Simply find the next unused one */
-				cpu = cpuset_first(cpus_available);
-				CPU_CLR(cpu, cpus_available);
-				CPU_SET(cpu, cpus_to_use);
+	for (i = 0; i < pe->nr_processes; ++i) {
+		pids[i] = -1;
+	}
+	pids[rank] = getpid();
 
-				cpu_prev = cpu;
-				dprintf("%s: CPU %d assigned (unused)\n",
-						__FUNCTION__, cpu);
-next_cpu:
-				continue;
-			}
+	ret = plan_shared_node(pe, pids);
+	free(pids);
+	if (ret < 0) {
+		fprintf(stderr, "%s: error: computing CPU partitions\n",
+				__FUNCTION__);
+		return -EINVAL;
+	}
+	trace_point(TRACE_PLAN);
 
-			/* Commit unused cores to shared memory */
-			memcpy(&pe->cpus_available, cpus_available, sizeof(*cpus_available));
-			memcpy(&pe->affinities[pe->process_rank],
-				cpus_to_use, sizeof(cpu_set_t));
-		}
+	ret = placement_take(pl, pe, rank);
+	if (ret < 0) {
+		fprintf(stderr, "%s: error: reading the plan of rank %d\n",
+				__FUNCTION__, rank);
+		return ret;
+	}
+
+	return bind_process(pl->bound) < 0 ? -EINVAL : rank;
+}
+
+
+/*
+ * Thread placement inside a rank.
+ */
+
+/*
+ * Binding related environment variables of MPI implementations and
+ * interconnect libraries which would override our placement.
+ */
+static const char *mpi_affinity_env[][2] = {
+	{ "MV2_ENABLE_AFFINITY",			"0" },		/* MVAPICH2 */
+	{ "I_MPI_PIN",					"0" },		/* Intel MPI */
+	{ "OMPI_MCA_hwloc_base_binding_policy",		"none" },	/* Open MPI */
+	{ "OMPI_MCA_mpi_paffinity_alone",		"0" },		/* Open MPI < 1.8 */
+	{ "HFI_NO_CPUAFFINITY",				"1" },		/* PSM2 */
+	{ "IPATH_NO_CPUAFFINITY",			"1" },		/* PSM */
+	{ NULL, NULL },
+};
+
+static const char *mpi_affinity_unset_env[] = {
+	"MV2_CPU_MAPPING",
+	"MV2_CPU_BINDING_POLICY",
+	"I_MPI_PIN_DOMAIN",
+	"I_MPI_PIN_PROCESSOR_LIST",
+	NULL,
+};
+
+static void disable_mpi_affinity(void)
+{
+	int i;
+
+	for (i = 0; mpi_affinity_env[i][0]; ++i) {
+		setenv(mpi_affinity_env[i][0], mpi_affinity_env[i][1], 1);
+	}
+
+	for (i = 0; mpi_affinity_unset_env[i]; ++i) {
+		unsetenv(mpi_affinity_unset_env[i]);
+	}
+}
 
-		pe->process_rank = 0;
-		free(cpus_to_use);
-		free(cpus_available);
+/*
+ * Export OpenMP places and the runtime specific affinity lists so
+ * that threads of the rank are bound to its CPUs in topological order.
+ */
+static int export_thread_placement(const struct rank_placement *placement)
+{
+	const int *cpus = placement->cpus;
+	int nr_cpus = placement->nr_cpus;
+	char *places = NULL;
+	char *gomp = NULL;
+	char *kmp = NULL;
+	char *list = NULL;
+	char *helper_list = NULL;
+	size_t len;
+	int i, cpu, pl, gl, kl, ll, hl;
+	int error = -ENOMEM;
+
+	/* Each CPU takes at most 5 digits + separators */
+	len = nr_cpu_ids * 8 + 64;
+	places = malloc(len);
+	gomp = malloc(len);
+	kmp = malloc(len);
+	list = malloc(len);
+	helper_list = malloc(len);
+	if (!places || !gomp || !kmp || !list || !helper_list) {
+		fprintf(stderr, "%s: error: allocating memory\n", __FUNCTION__);
+		goto out;
 	}
 
-	/* Reset if last process */
-	if (pe->nr_processes_left == 0) {
-		dprintf("%s: nr_processes: %d (partitioned exec ends)\n",
-				__FUNCTION__,
-				pe->nr_processes);
-		pe->nr_processes = -1;
-		memset(&pe->cpus_available, 0, sizeof(pe->cpus_available));
+	pl = gl = ll = 0;
+	kl = snprintf(kmp, len, "explicit,proclist=[");
+	for (i = 0; i < nr_cpus; ++i) {
+		ll += snprintf(list + ll, len - ll, "%s%d",
+				i ? "," : "", cpus[i]);
+		pl += snprintf(places + pl, len - pl, "%s{%d}",
+				i ? "," : "", cpus[i]);
+		gl += snprintf(gomp + gl, len - gl, "%s%d",
+				i ? " " : "", cpus[i]);
+		kl += snprintf(kmp + kl, len - kl, "%s%d",
+				i ? "," : "", cpus[i]);
+	}
+	snprintf(kmp + kl, len - kl, "]");
+
+	/* Helper CPUs form a separate place after the compute ones */
+	if (!cpumask_empty(placement->helpers)) {
+		hl = 0;
+		for_each_cpu(cpu, placement->helpers) {
+			hl += snprintf(helper_list + hl, len - hl, "%s%d",
+					hl ? "," : "", cpu);
+		}
+		snprintf(places + pl, len - pl, ",{%s}", helper_list);
+		setenv("MPIPIN_HELPER_CPUS", helper_list, 1);
 	}
-	/* Otherwise wake up next process in list */
 	else {
-		next_i = pe->first_process_ind;
-		pe->first_process_ind = pe->processes[next_i].next_process_ind;
+		unsetenv("MPIPIN_HELPER_CPUS");
+	}
+
+	setenv("OMP_PLACES", places, 1);
+	setenv("OMP_PROC_BIND", "close", 1);
+	setenv("GOMP_CPU_AFFINITY", gomp, 1);
+	setenv("KMP_AFFINITY", kmp, 1);
+	/* Ordered CPU list for libmpipin_threads */
+	setenv("MPIPIN_CPUS", list, 1);
+	dprintf("%s: OMP_PLACES=%s\n", __FUNCTION__, places);
+
+	error = 0;
+out:
+	free(helper_list);
+	free(list);
+	free(kmp);
+	free(gomp);
+	free(places);
+	return error;
+}
 
-		pe->processes[next_i].ready = 1;
-		dprintf("%s: waking PID %d\n",
-				__FUNCTION__, pe->processes[next_i].pid);
-		pthread_cond_signal(&pe->processes[next_i].wait_cv);
+#define MPIPIN_THREADS_LIB	"libmpipin_threads.so"
+
+/*
+ * Preload the thread pinning library, which is looked up next to the
+ * mpipin binary unless MPIPIN_THREADS_LIB points elsewhere.
+ */
+static int preload_thread_pinning(const char *policy)
+{
+	char lib[PATH_MAX];
+	char pid[16];
+	char *preload;
+	char *old;
+	char *p;
+	ssize_t n;
+
+	if (strcmp(policy, "share") && strcmp(policy, "float") &&
+			strcmp(policy, "helper")) {
+		fprintf(stderr, "%s: error: unknown thread policy %s\n",
+				__FUNCTION__, policy);
+		return -EINVAL;
 	}
 
-	dprintf("%s: rank: %d, ret: 0\n",
-			__FUNCTION__, pe->process_rank);
-	if (sched_setaffinity(0, sizeof(cpu_set_t),
-				&pe->affinities[pe->process_rank]) < 0) {
-		fprintf(stderr, "%s: error: setting CPU affinity\n",
-				__FUNCTION__);
-		ret = -EINVAL;
-		goto unlock_out;
+	if (getenv("MPIPIN_THREADS_LIB")) {
+		snprintf(lib, sizeof(lib), "%s", getenv("MPIPIN_THREADS_LIB"));
 	}
 	else {
-		char cpu_list[PAGE_SIZE];
-		bitmap_scnlistprintf(cpu_list, sizeof(cpu_list),
-				(unsigned long *)&pe->affinities[pe->process_rank],
-				sizeof(cpu_set_t) * BITS_PER_BYTE);
-		dprintf("%s: rank: %d, bound to CPUs: %s\n",
-				__FUNCTION__, pe->process_rank, cpu_list);
+		n = readlink("/proc/self/exe", lib, sizeof(lib) - 1);
+		if (n < 0) {
+			fprintf(stderr, "%s: error: resolving mpipin path\n",
+					__FUNCTION__);
+			return -EINVAL;
+		}
+		lib[n] = '\0';
+
+		p = strrchr(lib, '/');
+		if (!p || (p - lib) + 1 + strlen(MPIPIN_THREADS_LIB) >= sizeof(lib)) {
+			return -ENAMETOOLONG;
+		}
+		strcpy(p + 1, MPIPIN_THREADS_LIB);
 	}
 
-	ret = pe->process_rank;
-	++pe->process_rank;
+	if (access(lib, R_OK) < 0) {
+		fprintf(stderr, "%s: error: %s is not accessible\n",
+				__FUNCTION__, lib);
+		return -ENOENT;
+	}
 
-unlock_out:
-	pthread_mutex_unlock(&pe->lock);
+	old = getenv("LD_PRELOAD");
+	if (old && *old) {
+		preload = malloc(strlen(lib) + strlen(old) + 2);
+		if (!preload) {
+			return -ENOMEM;
+		}
+		sprintf(preload, "%s:%s", lib, old);
+	}
+	else {
+		preload = strdup(lib);
+		if (!preload) {
+			return -ENOMEM;
+		}
+	}
 
-	return ret;
+	/* Only this process is pinned, not its children */
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	setenv("MPIPIN_PID", pid, 1);
+	setenv("LD_PRELOAD", preload, 1);
+	setenv("MPIPIN_THREAD_POLICY", policy, 1);
+	free(preload);
+
+	return 0;
 }
 
 
@@ -1125,28 +3600,114 @@ unlock_out:
  * main()
  */
 
-#define MPIPIN_MAGIC	(0xEEEEABCD)
+/*
+ * Parse the threads per process specification, either a single number
+ * for all ranks, a list of numbers for consecutive ranks (2,12,12,12),
+ * or rank classes such as 0:2,1-3:8,*:12. Ranks not covered get an
+ * even share of the remaining CPUs (tpp 0).
+ */
+static int parse_tpp(char *spec, int ppn, int *tpp)
+{
+	char *item, *end, *saveptr = NULL;
+	char *str;
+	int star = 0;
+	int pos = 0;
+	int nr_items = 0;
+	int first, last, n, rank;
+	int error = -EINVAL;
+
+	str = strdup(spec);
+	if (!str) {
+		return -ENOMEM;
+	}
+
+	for (item = strtok_r(str, ",", &saveptr); item;
+			item = strtok_r(NULL, ",", &saveptr), ++nr_items) {
+		char *colon = strchr(item, ':');
+
+		if (!colon) {
+			first = last = pos++;
+			n = strtol(item, &end, 0);
+		}
+		else if (!strncmp(item, "*:", 2)) {
+			star = strtol(colon + 1, &end, 0);
+			if (*end != '\0' || star <= 0)
+				goto out;
+			continue;
+		}
+		else {
+			first = last = strtol(item, &end, 0);
+			if (*end == '-')
+				last = strtol(end + 1, &end, 0);
+			if (end != colon)
+				goto out;
+			n = strtol(colon + 1, &end, 0);
+		}
+
+		if (*end != '\0' || n <= 0 || first < 0 || last < first ||
+				last >= ppn) {
+			goto out;
+		}
+
+		for (rank = first; rank <= last; ++rank) {
+			tpp[rank] = n;
+		}
+	}
+
+	/* A single number applies to every rank */
+	if (nr_items == 1 && pos == 1) {
+		star = tpp[0];
+	}
+
+	for (rank = 0; rank < ppn; ++rank) {
+		if (!tpp[rank])
+			tpp[rank] = star;
+	}
+
+	error = 0;
+out:
+	free(str);
+	return error;
+}
 
 int main(int argc, char **argv)
 {
 	int error;
 	int ppn = 0;
-	int tpp = 0;
+	char *tpp_spec = NULL;
+	int *tpp = NULL;
+	char *order_spec = NULL;
+	int key_given = 0;
 	int opt;
 	int shm_fd;
 	int shm_created = 0;
-	int cpu;
 	int node_rank = 0;
+	int ticket;
 	pid_t ppid;
 	void *shm;
 	struct stat st;
 	size_t shm_size;
 	struct part_exec *pe;
-	cpu_set_t cpus_available;
-	cpu_set_t cpus_excluded;
-	char shm_path[PATH_MAX];
+	struct cpumask *cpus_available;
+	struct cpumask *cpus_excluded;
+	struct rank_placement placement;
+	char shm_path[PATH_MAX] = "";
+
+	start_ts = get_time_ns();
+	trace_ts[TRACE_ENTRY] = start_ts;
+
+	if (cpumask_setup() < 0) {
+		fprintf(stderr, "error: obtaining the number of CPUs\n");
+		exit(EXIT_FAILURE);
+	}
 
-	memset(&cpus_excluded, 0, sizeof(cpu_set_t));
+	cpus_available = cpumask_alloc();
+	cpus_excluded = cpumask_alloc();
+	if (!cpus_available || !cpus_excluded ||
+			placement_alloc(&placement) < 0) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
 
 	/* Parse options */
 	while ((opt = getopt_long(argc, argv, "+n:p:t:e:vh", options, NULL)) != -1) {
@@ -1163,16 +3724,11 @@ int main(int argc, char **argv)
 				break;
 
 			case 't':
-				tpp = strtol(optarg, &tmp, 0);
-				if (*tmp != '\0' || tpp <= 0) {
-					fprintf(stderr, "error: -t: invalid number of threads\n");
-					exit(EXIT_FAILURE);
-				}
+				tpp_spec = optarg;
 				break;
 
 			case 'e':
-				error = bitmap_parselist(optarg, (unsigned long int*)&cpus_excluded,
-						sizeof(cpu_set_t) * BITS_PER_BYTE);
+				error = cpumask_parselist(optarg, cpus_excluded);
 				if (error) {
 					fprintf(stderr, "error: parsing excluded CPU list\n");
 					exit(EXIT_FAILURE);
@@ -1183,6 +3739,54 @@ int main(int argc, char **argv)
 				verbose = 1;
 				break;
 
+			case 'T':
+				thread_policy = optarg ? optarg : "share";
+				break;
+
+			case 'D':
+				trace_dir = optarg;
+				break;
+
+			case 'O':
+				order_spec = optarg;
+				rank_order = optarg;
+				break;
+
+			case 'K':
+				key_given = 1;
+				rank_order = "key";
+				rank_key = strtol(optarg, &tmp, 0);
+				if (*tmp != '\0') {
+					fprintf(stderr, "error: --rank-key: invalid key\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'H':
+				if (!strncmp(optarg, "per-rank:", 9)) {
+					helper_mode = HELPER_PER_RANK;
+					tmp = optarg + 9;
+				}
+				else if (!strncmp(optarg, "per-node:", 9)) {
+					helper_mode = HELPER_PER_NODE;
+					tmp = optarg + 9;
+				}
+				else {
+					fprintf(stderr, "error: --helper-cpus: invalid mode\n");
+					exit(EXIT_FAILURE);
+				}
+
+				helper_cpus = strtol(tmp, &tmp, 0);
+				if (*tmp != '\0' || helper_cpus <= 0) {
+					fprintf(stderr, "error: --helper-cpus: invalid number of CPUs\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 0:
+				/* Flag options */
+				break;
+
 			case 'h':
 			default:
 				print_usage(argv);
@@ -1199,6 +3803,29 @@ int main(int argc, char **argv)
 
 	dprintf("exec: %s\n", argv[optind]);
 
+	/*
+	 * The ledger is updated by the planner for all the processes of the
+	 * job. Processes planning on their own would each see the CPUs of
+	 * their siblings as taken by nobody and place themselves on top.
+	 */
+	if (share_node && no_rendezvous) {
+		fprintf(stderr, "error: --share-node can't be used with --no-rendezvous\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (no_rendezvous) {
+		int local_size;
+
+		if (get_local_rank(&node_rank, &local_size) < 0) {
+			fprintf(stderr, "error: --no-rendezvous: the launcher doesn't "
+					"provide a node-local rank\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (ppn == 0)
+			ppn = local_size;
+	}
+
 	if (ppn == 0) {
 		fprintf(stderr, "error: you must specify the number of processes per node\n");
 		print_usage(argv);
@@ -1217,24 +3844,97 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);	
 	}
 
+	tpp = calloc(ppn, sizeof(*tpp));
+	if (!tpp) {
+		fprintf(stderr, "error: allocating memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (tpp_spec && parse_tpp(tpp_spec, ppn, tpp) < 0) {
+		fprintf(stderr, "error: -t: invalid threads per process: %s\n",
+				tpp_spec);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Otherwise whichever option came last would win silently */
+	if (key_given && order_spec && strcmp(order_spec, "key")) {
+		fprintf(stderr, "error: --rank-key conflicts with --rank-order=%s\n",
+				order_spec);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!no_rendezvous && get_rank_key(rank_order, &rank_key) < 0) {
+		fprintf(stderr, "error: --rank-order: can't order ranks by %s\n",
+				rank_order);
+		exit(EXIT_FAILURE);
+	}
+
 	/* Unset common pinning environment variables */
-	setenv("MV2_ENABLE_AFFINITY", "0", 1);
-	setenv("I_MPI_PIN", "0", 1);
+	disable_mpi_affinity();
 
 	INIT_LIST_HEAD(&cpu_topology_list);
 	INIT_LIST_HEAD(&node_topology_list);
 
 	ppid = getppid();
 
-	dprintf("[ppid: %d] ppn: %d, tpp: %d\n", ppid, ppn, tpp);
+	dprintf("[ppid: %d] ppn: %d, tpp: %s\n", ppid, ppn, tpp_spec);
 
 	/* Get affinity */
-	if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus_available) == -1) {
+	if (sched_getaffinity_mask(0, cpus_available) == -1) {
 		fprintf(stderr, "error: obtaining CPU affinity\n");
 		error = EXIT_FAILURE;
 		goto cleanup_shm;
 	}
 
+	if (share_node) {
+		ledger = open_ledger();
+		if (!ledger) {
+			fprintf(stderr, "error: opening the CPU ledger of the node\n");
+			error = EXIT_FAILURE;
+			goto cleanup_shm;
+		}
+	}
+
+	if (no_rendezvous) {
+		pe = calloc(1, part_exec_layout(NULL, ppn));
+		if (!pe) {
+			fprintf(stderr, "error: allocating memory\n");
+			error = EXIT_FAILURE;
+			goto cleanup_shm;
+		}
+		part_exec_layout(pe, ppn);
+
+		pe->nr_processes = ppn;
+		pe->helper_mode = helper_mode;
+		pe->helper_cpus = helper_cpus;
+		pe->block_placement = block_placement;
+		memcpy(pe_tpp(pe), tpp, sizeof(*tpp) * ppn);
+
+		if (get_job_cpus(pe_cpus_available(pe)) < 0) {
+			fprintf(stderr, "error: obtaining CPUs of the job\n");
+			error = EXIT_FAILURE;
+			goto cleanup_shm;
+		}
+
+		if (logical_cpus && logical_to_os_cpus(pe, cpus_excluded) < 0) {
+			fprintf(stderr, "error: translating excluded CPUs\n");
+			error = EXIT_FAILURE;
+			goto cleanup_shm;
+		}
+
+		cpumask_andnot(pe_cpus_available(pe), pe_cpus_available(pe),
+				cpus_excluded);
+
+		if ((node_rank = pin_process_local(pe, node_rank,
+						&placement)) < 0) {
+			fprintf(stderr, "error: pinning\n");
+			error = EXIT_FAILURE;
+			goto cleanup_shm;
+		}
+
+		goto pinned;
+	}
+
 #if 0
 	{
 		struct node_topology *node_topo;
@@ -1246,10 +3946,8 @@ int main(int argc, char **argv)
 			int cpu;
 			printf("NUMA: %d\n", node_topo->node_number);
 
-			for (cpu = 0; cpu < get_nprocs_conf(); ++cpu) {
-				if (CPU_ISSET(cpu, &node_topo->cpumap)) {
-					printf("  CPU: %d\n", cpu);
-				}
+			for_each_cpu(cpu, node_topo->cpumap) {
+				printf("  CPU: %d\n", cpu);
 
 				list_for_each_entry(cpu_topo_iter, &cpu_topology_list, list) {
 					if (cpu_topo_iter->cpu_id == cpu) {
@@ -1273,12 +3971,10 @@ int main(int argc, char **argv)
 					}
 					*/
 
-					for (scpu = 0; scpu < get_nprocs_conf(); ++scpu) {
-						if (CPU_ISSET(scpu, &cache_topo->shared_cpu_map)) {
-							printf("    Cache level: %ld (type: %s), CPU: %d shared\n",
-								cache_topo->level,
-								cache_topo->type, scpu);
-						}
+					for_each_cpu(scpu, cache_topo->shared_cpu_map) {
+						printf("    Cache level: %ld (type: %s), CPU: %d shared\n",
+							cache_topo->level,
+							cache_topo->type, scpu);
 					}
 				}
 			}
@@ -1286,22 +3982,27 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	/* Shared memory with other ranks */
-	sprintf(shm_path, "/mpipin.%d.shm", ppid);
+	/*
+	 * Shared memory with other ranks. The layout depends on ppn, steps
+	 * of a different size get a segment of their own.
+	 */
+	sprintf(shm_path, "/mpipin.%d.%d.shm", ppid, ppn);
 
+open_shm:
 	shm_fd = shm_open(shm_path, O_RDWR | O_CREAT, 0700);
 	if (shm_fd < 0) {
 		fprintf(stderr, "error: opening shared memory file\n");
 		perror("");
 		error = EXIT_FAILURE;
-		goto cleanup_shm;
+		goto out;
 	}
 
 	if (flock(shm_fd, LOCK_EX) < 0) {
 		fprintf(stderr, "error: locking shared memory\n");
 		error = EXIT_FAILURE;
-		goto cleanup_shm;
+		goto out;
 	}
+	trace_point(TRACE_FLOCK);
 
 	if (fstat(shm_fd, &st) < 0) {
 		fprintf(stderr, "error: stating shm file\n");
@@ -1309,12 +4010,27 @@ int main(int argc, char **argv)
 		goto unlock_cleanup_shm;
 	}
 
+	/* Removed by the previous step before we got the lock? */
+	if (st.st_nlink == 0) {
+		flock(shm_fd, LOCK_UN);
+		close(shm_fd);
+		goto open_shm;
+	}
+
 	dprintf("st_size: %lu\n", st.st_size);
-	shm_size = sizeof(struct part_exec);
 	if (st.st_size == 0) {
-		ftruncate(shm_fd, shm_size + PAGE_SIZE);
+		/* Sized for this job, a fresh segment reads as zeros */
+		shm_size = part_exec_layout(NULL, ppn);
+		if (ftruncate(shm_fd, shm_size) < 0) {
+			fprintf(stderr, "error: sizing shared memory file\n");
+			error = EXIT_FAILURE;
+			goto unlock_cleanup_shm;
+		}
 		shm_created = 1;
 	}
+	else {
+		shm_size = st.st_size;
+	}
 
 	shm = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
 	if (shm == MAP_FAILED) {
@@ -1325,114 +4041,121 @@ int main(int argc, char **argv)
 
 	pe = (struct part_exec *)shm;
 
-	dprintf("shm @ %p %s\n", shm, shm_created ? "(created)" : "(attached)");
+	dprintf("shm @ %p (%lu bytes) %s\n", shm, shm_size,
+			shm_created ? "(created)" : "(attached)");
+
+	if (!shm_created && (!part_exec_valid(pe, shm_size) ||
+				ppn != pe->nr_processes)) {
+		fprintf(stderr, "error: shared memory file %s doesn't belong to "
+				"a job of %d processes\n", shm_path, ppn);
+		error = EXIT_FAILURE;
+		goto unlock_cleanup_shm;
+	}
 
 	/* First process initializes shared memory variables */
 	if (shm_created) {
-		int pi;
-		memset(shm, 0, shm_size);
+		part_exec_layout(pe, ppn);
 
-		/* Cross-process mutex */
+		/* Cross-process mutex, recoverable if its owner dies */
 		pthread_mutexattr_init(&pe->lock_attr);
 		pthread_mutexattr_setpshared(&pe->lock_attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&pe->lock_attr, PTHREAD_MUTEX_ROBUST);
 		pthread_mutex_init(&pe->lock, &pe->lock_attr);
 
-		for (pi = 0; pi < MAX_PROCESSES; ++pi) {
-			pthread_condattr_init(&pe->processes[pi].wait_cv_attr);
-			pthread_condattr_setpshared(&pe->processes[pi].wait_cv_attr,
-					PTHREAD_PROCESS_SHARED);
-			pthread_cond_init(&pe->processes[pi].wait_cv,
-					&pe->processes[pi].wait_cv_attr);
-			pe->processes[pi].next_process_ind = -1;
-		}
-
-		pe->nr_processes = -1;
-		pe->nr_processes_left = -1;
-		pe->first_process_ind = -1;
-		pe->nr_processes_left_in_init = ppn - 1;
-
-		memcpy(&pe->cpus_available, &cpus_available, sizeof(cpu_set_t));
+		pe->nr_processes = ppn;
 	}
-	else {
-		/* Take union of allowed CPUs */
-		for_each_cpu(cpu, &cpus_available) {
-			CPU_SET(cpu, &pe->cpus_available);
-		}
-
-		--pe->nr_processes_left_in_init;
-		/* Last process discovers true CPU set available */
-		if (pe->nr_processes_left_in_init == 0) {
-			int cpu;
-
-			for (cpu = 0; cpu < get_nprocs_conf(); ++cpu) {
-				cpu_set_t target;
-
-				if (CPU_ISSET(cpu, &cpus_excluded)) {
-					continue;
-				}
 
-				if (CPU_ISSET(cpu, &pe->cpus_available)) {
-					dprintf("CPU %d is available\n", cpu);
-					continue;
-				}
-
-				/* Try to move */
-				memset(&target, 0, sizeof(target));
-				CPU_SET(cpu, &target);
-
-				if (sched_setaffinity(0, sizeof(cpu_set_t),
-							&target) < 0) {
-					continue;
-				}
-
-				if (sched_getcpu() == cpu) {
-					CPU_SET(cpu, &pe->cpus_available);
-					dprintf("CPU %d has been discovered as available\n", cpu);
-				}
-			}
-
-			/* Unset excluded CPUs.. */
-			for_each_cpu(cpu, &cpus_excluded) {
-				CPU_CLR(cpu, &pe->cpus_available);
-			}
-
-			pe->cpus_to_assign = CPU_COUNT(&pe->cpus_available) / ppn;
-			dprintf("%s: CPUs to assign: %d\n",
-					__FUNCTION__, pe->cpus_to_assign);
-		}
-	}
+	/* Our ticket, drawn under the lock, see unlink_segment() */
+	ticket = __atomic_fetch_add(&pe->next_ticket, 1, __ATOMIC_ACQ_REL);
 
 	if (flock(shm_fd, LOCK_UN) < 0) {
 		fprintf(stderr, "error: unlocking shared memory folder\n");
 		error = EXIT_FAILURE;
 		goto cleanup_shm;
 	}
+	trace_point(TRACE_SHM_ATTACH);
+
+	/* Once per job, by the creator of the segment */
+	if (shm_created)
+		reclaim_stale_segments(ppid);
 
 	/* We have the region, now wait for all processes and do the pin */
-	if ((node_rank = pin_process(pe, ppn)) < 0) {
+	if ((node_rank = pin_process(pe, ppn, tpp, cpus_available,
+					cpus_excluded, ticket, &placement)) < 0) {
 		fprintf(stderr, "error: pinning\n");
 		error = EXIT_FAILURE;
 		goto cleanup_shm;
 	}
 
-	shm_unlink(shm_path);
+	/* Keep the segment for the next step of the job if asked */
+	if (!reuse_shm)
+		unlink_segment(pe, shm_fd, shm_path, ppn, ticket);
+
+pinned:
+	if (export_thread_placement(&placement) < 0) {
+		fprintf(stderr, "error: exporting thread placement\n");
+		error = EXIT_FAILURE;
+		goto cleanup_shm;
+	}
 
 	if (verbose) {
+		const char *order = getenv("MPIPIN_CPUS");
+		const char *helper_order = getenv("MPIPIN_HELPER_CPUS");
+		char order_buf[1024];
+		char helper_buf[1024];
 		char mask[1024];
 		char host[512];
 
-		/* Get affinity */
-		if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus_available) == -1) {
-			fprintf(stderr, "error: obtaining CPU affinity\n");
-			error = EXIT_FAILURE;
-			goto cleanup_shm;
+		/*
+		 * Report in logical numbers, from the order we took along,
+		 * otherwise straight from the ranges bound to.
+		 */
+		if (logical_cpus) {
+			struct cpumask *logical = cpumask_alloc();
+
+			cpurange_to_cpumask(cpus_available, placement.bound);
+			if (!logical ||
+					setup_cpu_numbering(&cpu_numbering,
+						placement.cpu_order) < 0 ||
+					remap_cpus(&cpu_numbering, logical,
+						cpus_available, 1) < 0) {
+				fprintf(stderr, "error: translating CPU numbers\n");
+				cpumask_free(logical);
+				error = EXIT_FAILURE;
+				goto cleanup_shm;
+			}
+			/* Logical numbers don't form more ranges than CPUs */
+			cpurange_from_cpumask(placement.bound, logical);
+			cpumask_free(logical);
+
+			scn_logical_list(order_buf, sizeof(order_buf), order,
+					placement.cpu_order);
+			order = order_buf;
+			if (helper_order) {
+				scn_logical_list(helper_buf, sizeof(helper_buf),
+						helper_order, placement.cpu_order);
+				helper_order = helper_buf;
+			}
 		}
 
 		gethostname(host, sizeof(host));
-		bitmap_scnlistprintf(mask, sizeof(mask),
-				(const long unsigned int *)&cpus_available,
-				sizeof(cpu_set_t) * BITS_PER_BYTE);
-		printf("process %d @ %s pinned to CPU(s): %s\n", node_rank, host, mask);
+		cpurange_scnlistprintf(mask, sizeof(mask), placement.bound);
+		printf("process %d @ %s pinned to CPU(s): %s (thread order: %s%s%s)\n",
+				node_rank, host, mask, order,
+				helper_order ? ", helpers: " : "",
+				helper_order ? helper_order : "");
+	}
+
+	if (thread_policy && preload_thread_pinning(thread_policy) < 0) {
+		fprintf(stderr, "error: setting up thread pinning\n");
+		error = EXIT_FAILURE;
+		goto cleanup_shm;
+	}
+
+	if (trace_dir) {
+		trace_point(TRACE_EXEC);
+		/* Tracing is best effort, don't fail the job */
+		write_trace(trace_dir, node_rank);
 	}
 
 	fflush(stdout);
@@ -1445,8 +4168,9 @@ int main(int argc, char **argv)
 	error = EXIT_FAILURE;
 
 cleanup_shm:
-	shm_unlink(shm_path);
-
+	if (shm_path[0])
+		shm_unlink(shm_path);
+out:
 	return error;
 
 unlock_cleanup_shm:
@@ -1455,7 +4179,10 @@ unlock_cleanup_shm:
 		error = EXIT_FAILURE;
 	}
 
-	goto cleanup_shm;
+	/* Not attached yet, a segment we didn't create may be in use */
+	if (shm_created)
+		goto cleanup_shm;
+	goto out;
 }
 
 
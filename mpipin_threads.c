@@ -0,0 +1,340 @@
+/*
+ * libmpipin_threads: pin threads of a rank to its CPUs.
+ *
+ * Preloaded by mpipin --pin-threads for threading runtimes which don't
+ * honor OpenMP places (TBB, std::thread, custom pthread pools, etc.).
+ * Every thread created through pthread_create() is bound to the next
+ * CPU of the rank in the topological order exported by mpipin in
+ * MPIPIN_CPUS. Threads beyond the number of CPUs are handled according
+ * to MPIPIN_THREAD_POLICY:
+ *
+ *   share   wrap around and share CPUs with earlier threads (default)
+ *   float   let the thread float over all CPUs of the rank
+ *   helper  bind the thread to MPIPIN_HELPER_CPUS (float if not set)
+ *
+ * Only the process mpipin executed (MPIPIN_PID) is pinned. The library
+ * removes itself and its variables from the environment, so that
+ * children of the rank, or of a wrapper script, aren't pinned on top of
+ * it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+//#define DEBUG
+
+#ifdef DEBUG
+#define dprintf(FORMAT, ...) fprintf(stderr, "[mpipin_threads] "FORMAT, ##__VA_ARGS__)
+#else
+#define dprintf(...)
+#endif
+
+enum thread_policy {
+	THREAD_POLICY_SHARE,
+	THREAD_POLICY_FLOAT,
+	THREAD_POLICY_HELPER,
+};
+
+typedef int (*pthread_create_fn)(pthread_t *, const pthread_attr_t *,
+		void *(*)(void *), void *);
+
+static pthread_create_fn real_pthread_create;
+static enum thread_policy policy = THREAD_POLICY_SHARE;
+static int *cpus;
+static int nr_cpus;
+/* CPU sets are sized for the highest CPU listed, which may exceed CPU_SETSIZE */
+static int max_cpus;
+static size_t set_size;
+static cpu_set_t *rank_cpus;
+static cpu_set_t *helper_cpus;
+/* The main thread is thread 0 */
+static int next_thread = 1;
+
+struct thread_start {
+	void *(*start_routine)(void *);
+	void *arg;
+	/* set_size bytes */
+	cpu_set_t cpus[0];
+};
+
+/*
+ * Highest CPU number in a comma separated list, -1 if there is none.
+ */
+static long highest_cpu(const char *str)
+{
+	long cpu, max = -1;
+	char *end;
+
+	while (*str) {
+		cpu = strtol(str, &end, 10);
+		if (end == str)
+			break;
+
+		if (cpu > max)
+			max = cpu;
+		str = *end == ',' ? end + 1 : end;
+	}
+
+	return max;
+}
+
+/*
+ * Drop this library from LD_PRELOAD and the placement variables from
+ * the environment, children start unpinned.
+ */
+static void clean_environment(void)
+{
+	const char *preload = getenv("LD_PRELOAD");
+	const char *entry, *end;
+	char *rest;
+	size_t len, n = 0;
+	Dl_info info;
+
+	unsetenv("MPIPIN_PID");
+	unsetenv("MPIPIN_CPUS");
+	unsetenv("MPIPIN_HELPER_CPUS");
+	unsetenv("MPIPIN_THREAD_POLICY");
+
+	if (!preload || !dladdr((void *)clean_environment, &info) ||
+			!info.dli_fname)
+		return;
+
+	rest = malloc(strlen(preload) + 1);
+	if (!rest)
+		return;
+
+	/* Entries are separated by colons or spaces */
+	for (entry = preload; *entry; entry = *end ? end + 1 : end) {
+		end = entry + strcspn(entry, ": ");
+		len = end - entry;
+		if (!len || (len == strlen(info.dli_fname) &&
+					!strncmp(entry, info.dli_fname, len)))
+			continue;
+
+		if (n)
+			rest[n++] = ':';
+		memcpy(rest + n, entry, len);
+		n += len;
+	}
+	rest[n] = '\0';
+
+	if (n)
+		setenv("LD_PRELOAD", rest, 1);
+	else
+		unsetenv("LD_PRELOAD");
+	free(rest);
+}
+
+/*
+ * Parse a comma separated list of CPU numbers. Returns the number
+ * of CPUs parsed or -1 on malformed input.
+ */
+static int parse_cpus(const char *str, int *list, int max, cpu_set_t *set)
+{
+	int nr = 0;
+	char *end;
+	long cpu;
+
+	CPU_ZERO_S(set_size, set);
+	while (*str) {
+		cpu = strtol(str, &end, 10);
+		if (end == str || cpu < 0 || cpu >= max_cpus)
+			return -1;
+
+		if (list && nr < max)
+			list[nr] = cpu;
+		CPU_SET_S(cpu, set_size, set);
+		++nr;
+
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			return -1;
+		str = end;
+	}
+
+	return nr;
+}
+
+__attribute__((constructor))
+static void mpipin_threads_init(void)
+{
+	const char *env, *helper_env;
+	cpu_set_t *main_cpu = NULL;
+	char *end;
+	long max;
+
+	real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+
+	/* Inherited by a child of the rank? */
+	env = getenv("MPIPIN_PID");
+	if (!env || strtol(env, &end, 10) != getpid() || *end != '\0') {
+		dprintf("not the pinned process, passing through\n");
+		clean_environment();
+		return;
+	}
+
+	env = getenv("MPIPIN_THREAD_POLICY");
+	if (env) {
+		if (!strcmp(env, "share"))
+			policy = THREAD_POLICY_SHARE;
+		else if (!strcmp(env, "float"))
+			policy = THREAD_POLICY_FLOAT;
+		else if (!strcmp(env, "helper"))
+			policy = THREAD_POLICY_HELPER;
+		else
+			fprintf(stderr, "mpipin_threads: warning: unknown thread policy %s\n",
+					env);
+	}
+
+	env = getenv("MPIPIN_CPUS");
+	if (!env)
+		goto out;
+
+	helper_env = getenv("MPIPIN_HELPER_CPUS");
+	max = highest_cpu(env);
+	if (helper_env && highest_cpu(helper_env) > max)
+		max = highest_cpu(helper_env);
+	if (max < 0 || max >= INT_MAX)
+		goto invalid;
+
+	max_cpus = max + 1;
+	set_size = CPU_ALLOC_SIZE(max_cpus);
+
+	cpus = malloc(sizeof(*cpus) * max_cpus);
+	rank_cpus = CPU_ALLOC(max_cpus);
+	helper_cpus = CPU_ALLOC(max_cpus);
+	main_cpu = CPU_ALLOC(max_cpus);
+	if (!cpus || !rank_cpus || !helper_cpus || !main_cpu)
+		goto out;
+
+	nr_cpus = parse_cpus(env, cpus, max_cpus, rank_cpus);
+	if (nr_cpus <= 0)
+		goto invalid;
+
+	if (!helper_env || parse_cpus(helper_env, NULL, 0, helper_cpus) <= 0)
+		memcpy(helper_cpus, rank_cpus, set_size);
+
+	CPU_ZERO_S(set_size, main_cpu);
+	CPU_SET_S(cpus[0], set_size, main_cpu);
+	if (sched_setaffinity(0, set_size, main_cpu) < 0) {
+		fprintf(stderr, "mpipin_threads: warning: pinning main thread\n");
+	}
+
+	dprintf("%d CPUs, policy: %d\n", nr_cpus, policy);
+	goto out;
+
+invalid:
+	fprintf(stderr, "mpipin_threads: warning: invalid MPIPIN_CPUS, "
+			"threads won't be pinned\n");
+	nr_cpus = 0;
+out:
+	if (main_cpu)
+		CPU_FREE(main_cpu);
+	clean_environment();
+}
+
+static void thread_cpus(int thread, cpu_set_t *set)
+{
+	if (thread < nr_cpus) {
+		CPU_ZERO_S(set_size, set);
+		CPU_SET_S(cpus[thread], set_size, set);
+		return;
+	}
+
+	switch (policy) {
+		case THREAD_POLICY_SHARE:
+			CPU_ZERO_S(set_size, set);
+			CPU_SET_S(cpus[thread % nr_cpus], set_size, set);
+			break;
+
+		case THREAD_POLICY_FLOAT:
+			memcpy(set, rank_cpus, set_size);
+			break;
+
+		case THREAD_POLICY_HELPER:
+			memcpy(set, helper_cpus, set_size);
+			break;
+	}
+}
+
+/*
+ * The new thread binds itself before running any user code.
+ */
+static void *thread_start(void *arg)
+{
+	struct thread_start *ts = arg;
+	void *(*start_routine)(void *) = ts->start_routine;
+	void *start_arg = ts->arg;
+
+	if (sched_setaffinity(0, set_size, ts->cpus) < 0) {
+		dprintf("error: setting thread affinity\n");
+	}
+	free(ts);
+
+	return start_routine(start_arg);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		void *(*start_routine)(void *), void *arg)
+{
+	struct thread_start *ts;
+	int ret;
+
+	if (!real_pthread_create) {
+		real_pthread_create = (pthread_create_fn)dlsym(RTLD_NEXT,
+				"pthread_create");
+		if (!real_pthread_create)
+			return EAGAIN;
+	}
+
+	if (!nr_cpus)
+		goto passthrough;
+
+	/* Respect threads explicitly bound by the application */
+	if (attr) {
+		cpu_set_t *attr_cpus = CPU_ALLOC(max_cpus);
+		int bound;
+
+		if (!attr_cpus)
+			goto passthrough;
+
+		/*
+		 * EINVAL means the attribute's mask has CPUs beyond ours,
+		 * i.e., it was set explicitly.
+		 */
+		ret = pthread_attr_getaffinity_np(attr, set_size, attr_cpus);
+		bound = ret == EINVAL || (ret == 0 &&
+				CPU_COUNT_S(set_size, attr_cpus) <
+				(int)(set_size * 8));
+		CPU_FREE(attr_cpus);
+		if (bound)
+			goto passthrough;
+	}
+
+	ts = malloc(sizeof(*ts) + set_size);
+	if (!ts)
+		goto passthrough;
+
+	ts->start_routine = start_routine;
+	ts->arg = arg;
+	thread_cpus(__atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED),
+			ts->cpus);
+
+	ret = real_pthread_create(thread, attr, thread_start, ts);
+	if (ret)
+		free(ts);
+
+	return ret;
+
+passthrough:
+	return real_pthread_create(thread, attr, start_routine, arg);
+}